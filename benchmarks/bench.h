@@ -0,0 +1,43 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <SDL.h>
+#include "renderer.h"
+
+/* Setup shared by the benchmarks: a hidden window, on the dummy video driver
+   unless SDL_VIDEODRIVER asks for another one, and a monotonic clock. */
+
+static inline RenWindow* bench_init(int width, int height) {
+  SDL_setenv("SDL_VIDEODRIVER", "dummy", 0);
+  if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_EVENTS) != 0) {
+    fprintf(stderr, "Error initializing SDL: %s\n", SDL_GetError());
+    exit(1);
+  }
+  SDL_Window *window = SDL_CreateWindow("", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED,
+    width, height, SDL_WINDOW_HIDDEN);
+  if (!window) {
+    fprintf(stderr, "Error creating window: %s\n", SDL_GetError());
+    exit(1);
+  }
+  RenWindow *window_renderer = ren_init(window);
+  if (!window_renderer)
+    exit(1);
+  return window_renderer;
+}
+
+static inline RenFont* bench_load_font(RenWindow *window_renderer, const char *path, float size) {
+  RenFont *font = ren_font_load(window_renderer, path, size, FONT_ANTIALIASING_SUBPIXEL, FONT_HINTING_SLIGHT, 0);
+  if (!font) {
+    fprintf(stderr, "Error loading font %s\n", path);
+    exit(1);
+  }
+  return font;
+}
+
+static inline double bench_time(void) {
+  return (double) SDL_GetPerformanceCounter() / SDL_GetPerformanceFrequency();
+}
+
+#endif
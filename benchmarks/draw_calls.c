@@ -0,0 +1,92 @@
+/* Cost of draw calls made from Lua.
+
+   Every frame draws a grid of rects with renderer.draw_rect, taking their
+   colors from a palette, as the views do with the style colors. The palette
+   holds color tables in a first run and renderer.color objects in a second
+   one; the frames are the same otherwise, so the difference is the time spent
+   reading the colors.
+
+   Usage: draw_calls [FRAMES] */
+
+#include "bench.h"
+#include "rencache.h"
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+
+#define WIDTH 1600
+#define HEIGHT 1000
+#define DRAW_CALLS 10000
+#define WARMUP_FRAMES 20
+
+int luaopen_renderer(lua_State *L);
+
+static const char *frame_code =
+  "local color_objects, calls, width, height = ...\n"
+  "local palette = {}\n"
+  "for i = 1, 16 do\n"
+  "  local color = { i * 15, 255 - i * 15, 128, 255 }\n"
+  "  palette[i] = color_objects and renderer.color.new(color) or color\n"
+  "end\n"
+  "local columns = math.ceil(math.sqrt(calls * width / height))\n"
+  "local w, h = width / columns, height / math.ceil(calls / columns)\n"
+  "local draw_rect = renderer.draw_rect\n"
+  "return function()\n"
+  "  renderer.begin_frame()\n"
+  "  renderer.set_clip_rect(0, 0, width, height)\n"
+  "  for i = 0, calls - 1 do\n"
+  "    draw_rect(i % columns * w, i // columns * h, w - 1, h - 1, palette[i % 16 + 1])\n"
+  "  end\n"
+  "  renderer.end_frame()\n"
+  "end\n";
+
+
+static void check_lua(lua_State *L, int status) {
+  if (status != LUA_OK) {
+    fprintf(stderr, "Error: %s\n", lua_tostring(L, -1));
+    exit(1);
+  }
+}
+
+
+static double run_frames(lua_State *L, int color_objects, int frames) {
+  check_lua(L, luaL_loadstring(L, frame_code));
+  lua_pushboolean(L, color_objects);
+  lua_pushinteger(L, DRAW_CALLS);
+  lua_pushinteger(L, WIDTH);
+  lua_pushinteger(L, HEIGHT);
+  check_lua(L, lua_pcall(L, 4, 1, 0));
+
+  for (int frame = 0; frame < WARMUP_FRAMES; frame++) {
+    lua_pushvalue(L, -1);
+    check_lua(L, lua_pcall(L, 0, 0, 0));
+  }
+  double start = bench_time();
+  for (int frame = 0; frame < frames; frame++) {
+    lua_pushvalue(L, -1);
+    check_lua(L, lua_pcall(L, 0, 0, 0));
+  }
+  double elapsed = bench_time() - start;
+  lua_pop(L, 1);
+  return elapsed / frames;
+}
+
+
+int main(int argc, char **argv) {
+  int frames = argc > 1 ? atoi(argv[1]) : 200;
+  window_renderer = bench_init(WIDTH, HEIGHT);
+  lua_State *L = luaL_newstate();
+  luaL_openlibs(L);
+  luaL_requiref(L, "renderer", luaopen_renderer, 1);
+  lua_pop(L, 1);
+
+  double tables = run_frames(L, 0, frames);
+  double objects = run_frames(L, 1, frames);
+  printf("%d draw calls per frame, %d frames: %.3f ms per frame with color tables, %.3f ms with color objects\n",
+    DRAW_CALLS, frames, tables * 1000, objects * 1000);
+
+  lua_close(L);
+  rencache_shutdown();
+  ren_free(window_renderer);
+  return 0;
+}
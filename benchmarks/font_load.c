@@ -0,0 +1,149 @@
+/* Cold load time of fonts with a large coverage.
+
+   Each round loads the font without a glyph cache directory, so nothing
+   comes from cache files, then looks up the metrics of every codepoint the
+   font maps, as laying out text does, and finally draws all of them and
+   waits for the rasterizer to put their bitmaps in the atlas.
+
+   Usage: font_load FONT... [-r ROUNDS] */
+
+#include <string.h>
+#include <ft2build.h>
+#include FT_FREETYPE_H
+#include "bench.h"
+#include "renwindow.h"
+
+#define WIDTH 1600
+#define HEIGHT 1000
+#define FONT_SIZE 15
+#define GLYPHS_PER_LINE 64
+
+typedef struct {
+  char *text;
+  size_t len;
+  int codepoints;
+} FontCoverage;
+
+
+static int utf8_encode(unsigned codepoint, char *dst) {
+  if (codepoint < 0x80) {
+    dst[0] = codepoint;
+    return 1;
+  }
+  if (codepoint < 0x800) {
+    dst[0] = 0xc0 | (codepoint >> 6);
+    dst[1] = 0x80 | (codepoint & 0x3f);
+    return 2;
+  }
+  if (codepoint < 0x10000) {
+    dst[0] = 0xe0 | (codepoint >> 12);
+    dst[1] = 0x80 | ((codepoint >> 6) & 0x3f);
+    dst[2] = 0x80 | (codepoint & 0x3f);
+    return 3;
+  }
+  dst[0] = 0xf0 | (codepoint >> 18);
+  dst[1] = 0x80 | ((codepoint >> 12) & 0x3f);
+  dst[2] = 0x80 | ((codepoint >> 6) & 0x3f);
+  dst[3] = 0x80 | (codepoint & 0x3f);
+  return 4;
+}
+
+
+/* every printable codepoint mapped by the font, as UTF-8 */
+static FontCoverage font_coverage(const char *path) {
+  FT_Library library;
+  FT_Face face;
+  FontCoverage coverage = { 0 };
+  if (FT_Init_FreeType(&library) || FT_New_Face(library, path, 0, &face)) {
+    fprintf(stderr, "Error opening font %s\n", path);
+    exit(1);
+  }
+  size_t capacity = 0;
+  FT_UInt glyph_index;
+  for (FT_ULong codepoint = FT_Get_First_Char(face, &glyph_index); glyph_index; codepoint = FT_Get_Next_Char(face, codepoint, &glyph_index)) {
+    if (codepoint < 0x20 || (codepoint >= 0x7f && codepoint < 0xa0) || codepoint >= 0x110000)
+      continue;
+    if (coverage.len + 4 > capacity) {
+      capacity = capacity ? capacity * 2 : 4096;
+      coverage.text = realloc(coverage.text, capacity);
+    }
+    coverage.len += utf8_encode(codepoint, coverage.text + coverage.len);
+    coverage.codepoints++;
+  }
+  FT_Done_Face(face);
+  FT_Done_FreeType(library);
+  return coverage;
+}
+
+
+/* the byte length of the first count codepoints of text */
+static size_t utf8_prefix(const char *text, size_t len, int count) {
+  size_t i = 0;
+  for (; i < len && count > 0; count--) {
+    i++;
+    while (i < len && (text[i] & 0xc0) == 0x80)
+      i++;
+  }
+  return i;
+}
+
+
+static void draw_coverage(RenWindow *window_renderer, RenFont **fonts, const FontCoverage *coverage) {
+  RenSurface rs = renwin_get_surface(window_renderer);
+  const RenColor color = { 0xe6, 0xe1, 0xe1, 0xff };
+  int line_height = ren_font_group_get_height(fonts);
+  int y = 0;
+  for (size_t i = 0; i < coverage->len; y = (y + line_height) % (HEIGHT - line_height)) {
+    size_t len = utf8_prefix(coverage->text + i, coverage->len - i, GLYPHS_PER_LINE);
+    ren_draw_text(&rs, fonts, coverage->text + i, len, 0, y, color, 4);
+    i += len;
+  }
+}
+
+
+int main(int argc, char **argv) {
+  int rounds = 5;
+  const char *paths[16];
+  int path_count = 0;
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "-r") && i + 1 < argc)
+      rounds = atoi(argv[++i]);
+    else if (path_count < (int) (sizeof(paths) / sizeof(paths[0])))
+      paths[path_count++] = argv[i];
+  }
+  if (path_count == 0) {
+    fprintf(stderr, "usage: %s FONT... [-r ROUNDS]\n", argv[0]);
+    return 1;
+  }
+  RenWindow *window_renderer = bench_init(WIDTH, HEIGHT);
+  ren_set_font_cache_dir(NULL);
+  ren_set_clip_rect(window_renderer, (RenRect) { 0, 0, WIDTH, HEIGHT });
+
+  for (int p = 0; p < path_count; p++) {
+    FontCoverage coverage = font_coverage(paths[p]);
+    double load = 0, metrics = 0, bitmaps = 0;
+    for (int round = 0; round < rounds; round++) {
+      double start = bench_time();
+      RenFont *fonts[FONT_FALLBACK_MAX] = { bench_load_font(window_renderer, paths[p], FONT_SIZE) };
+      double loaded = bench_time();
+      ren_font_group_get_width(window_renderer, fonts, coverage.text, coverage.len, NULL);
+      double measured = bench_time();
+      draw_coverage(window_renderer, fonts, &coverage);
+      while (ren_get_pending_glyphs() > 0)
+        SDL_Delay(1);
+      double drawn = bench_time();
+      ren_font_free(fonts[0]);
+      /* the atlas is trimmed between frames */
+      ren_update_rects(window_renderer, &(RenRect) { 0, 0, 1, 1 }, 1);
+      load += loaded - start;
+      metrics += measured - loaded;
+      bitmaps += drawn - measured;
+    }
+    printf("%s: %d codepoints, %d rounds: %.3f ms load, %.3f ms metrics, %.3f ms bitmaps per round\n",
+      paths[p], coverage.codepoints, rounds, load / rounds * 1000, metrics / rounds * 1000, bitmaps / rounds * 1000);
+    free(coverage.text);
+  }
+
+  ren_free(window_renderer);
+  return 0;
+}
@@ -0,0 +1,106 @@
+/* Frame time of rencache on a full-screen code view.
+
+   Every frame draws the background, the gutter and the tokens of each line,
+   like DocView does. The first line changes from one frame to the next, as
+   when typing at the top of the view, so the commands of the whole frame are
+   hashed again and the changed cells are redrawn.
+
+   Usage: rencache_frame FONT [FRAMES] */
+
+#include <string.h>
+#include "bench.h"
+#include "rencache.h"
+
+#define WIDTH 1600
+#define HEIGHT 1000
+#define WARMUP_FRAMES 20
+
+static const char *line_tokens[] = {
+  "  ", "local", " ", "function", " ", "core.step", "(", "view", ",", " ",
+  "dt", ")", " ", "-- update the view", "\n"
+};
+static const char *line_tokens2[] = {
+  "    ", "if", " ", "self.size.x", " ", "~=", " ", "width", " ", "then",
+  " ", "return", " ", "\"resized\"", " ", "end", "\n"
+};
+
+static const RenColor token_colors[] = {
+  { 0xe6, 0xe1, 0xe1, 0xff }, { 0xc9, 0x8a, 0xe5, 0xff },
+  { 0x83, 0x74, 0xf7, 0xff }, { 0xfa, 0xdd, 0x93, 0xff },
+  { 0x5c, 0xc9, 0xf7, 0xff }, { 0x6f, 0x6b, 0x67, 0xff },
+};
+
+
+static int draw_line(RenWindow *window_renderer, RenFont **fonts, const char **tokens, int count, double x, int y) {
+  int commands = 0;
+  for (int i = 0; i < count; i++) {
+    size_t len = strlen(tokens[i]);
+    if (tokens[i][len - 1] == '\n')
+      len--;
+    RenColor color = token_colors[i % (sizeof(token_colors) / sizeof(token_colors[0]))];
+    x = rencache_draw_text(window_renderer, fonts, tokens[i], len, x, y, color);
+    commands++;
+  }
+  return commands;
+}
+
+
+static int draw_frame(RenWindow *window_renderer, RenFont **fonts, int frame) {
+  const RenColor background = { 0x32, 0x2e, 0x2e, 0xff };
+  const RenColor gutter = { 0x29, 0x25, 0x25, 0xff };
+  const RenColor line_number = { 0x59, 0x52, 0x52, 0xff };
+  int line_height = ren_font_group_get_height(fonts) * 1.2;
+  int commands = 2;
+
+  rencache_begin_frame(window_renderer);
+  rencache_set_clip_rect(window_renderer, (RenRect) { 0, 0, WIDTH, HEIGHT });
+  rencache_draw_rect(window_renderer, (RenRect) { 0, 0, WIDTH, HEIGHT }, background);
+  rencache_draw_rect(window_renderer, (RenRect) { 0, 0, 60, HEIGHT }, gutter);
+  for (int line = 0, y = 0; y < HEIGHT; line++, y += line_height) {
+    char text[32];
+    int len = snprintf(text, sizeof(text), "%d", line + 1);
+    rencache_draw_text(window_renderer, fonts, text, len, 10, y, line_number);
+    if (line == 0) {
+      /* the line being typed */
+      len = snprintf(text, sizeof(text), "local typed = %d", frame);
+      rencache_draw_text(window_renderer, fonts, text, len, 70, y, token_colors[0]);
+      commands += 2;
+      continue;
+    }
+    if (line % 2)
+      commands += draw_line(window_renderer, fonts, line_tokens, sizeof(line_tokens) / sizeof(line_tokens[0]), 70, y);
+    else
+      commands += draw_line(window_renderer, fonts, line_tokens2, sizeof(line_tokens2) / sizeof(line_tokens2[0]), 70, y);
+    commands++;
+  }
+  rencache_end_frame(window_renderer);
+  return commands;
+}
+
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s FONT [FRAMES]\n", argv[0]);
+    return 1;
+  }
+  int frames = argc > 2 ? atoi(argv[2]) : 500;
+  RenWindow *window_renderer = bench_init(WIDTH, HEIGHT);
+  RenFont *fonts[FONT_FALLBACK_MAX] = { bench_load_font(window_renderer, argv[1], 15) };
+
+  /* the glyphs are rasterized and the buffers grown before measuring */
+  for (int frame = 0; frame < WARMUP_FRAMES || ren_get_pending_glyphs() > 0; frame++)
+    draw_frame(window_renderer, fonts, frame);
+
+  int commands = 0;
+  double start = bench_time();
+  for (int frame = 0; frame < frames; frame++)
+    commands = draw_frame(window_renderer, fonts, WARMUP_FRAMES + frame);
+  double elapsed = bench_time() - start;
+
+  printf("%d commands per frame, %d frames: %.3f ms per frame\n", commands, frames, elapsed / frames * 1000);
+
+  rencache_shutdown();
+  ren_font_free(fonts[0]);
+  ren_free(window_renderer);
+  return 0;
+}
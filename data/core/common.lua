@@ -74,18 +74,24 @@ end
 ---Returns a value between a and b on a linear scale, based on the
 ---interpolation point t.
 ---
----If a and b are tables, a table containing the result for all the
----elements in a and b is returned.
+---If a and b are tables or colors, a table containing the result for all
+---the elements in a and b is returned.
 ---@param a number
 ---@param b number
 ---@param t number
 ---@return number
 ---@overload fun(a: table, b: table, t: number): table
 function common.lerp(a, b, t)
-  if type(a) ~= "table" then
+  if not common.is_color(a) then
     return a + (b - a) * t
   end
   local res = {}
+  if getmetatable(b) == renderer.color then
+    for i = 1, #b do
+      res[i] = common.lerp(a[i], b[i], t)
+    end
+    return res
+  end
   for k, v in pairs(b) do
     res[k] = common.lerp(a[k], v, t)
   end
@@ -136,6 +142,51 @@ function common.color(str)
 end
 
 
+---Checks if a value is a color, either a color table or a renderer.color.
+---Any table is taken for a color, like in styled text where colors are told
+---apart from fonts and strings.
+---@param value any
+---@return boolean
+function common.is_color(value)
+  return type(value) == "table" or getmetatable(value) == renderer.color
+end
+
+
+local function is_color_table(t)
+  local n = 0
+  for k, v in pairs(t) do
+    if math.type(k) ~= "integer" or k < 1 or k > 4 or type(v) ~= "number" then
+      return false
+    end
+    n = n + 1
+  end
+  return n >= 3 and t[1] ~= nil and t[2] ~= nil and t[3] ~= nil
+end
+
+
+---Replaces the color tables of a table, and of the plain tables in it, with
+---renderer.color objects, which draw calls read without indexing a table.
+---A color table found in several places is replaced by the same object.
+---@param t table
+---@param converted? table<table, table|renderer.color>
+function common.convert_colors(t, converted)
+  converted = converted or { [t] = t }
+  for k, v in pairs(t) do
+    if type(v) == "table" and getmetatable(v) == nil then
+      if not converted[v] then
+        if is_color_table(v) then
+          converted[v] = renderer.color.new(v)
+        else
+          converted[v] = v
+          common.convert_colors(v, converted)
+        end
+      end
+      t[k] = converted[v]
+    end
+  end
+end
+
+
 ---Splices a numerically indexed table.
 ---This function mutates the original table.
 ---@param t any[]
@@ -5,11 +5,27 @@ local config = {}
 ---The frame rate of Lite XL.
 ---Note that setting this value to the screen's refresh rate
 ---does not eliminate screen tearing.
+---Frames are never drawn faster than the refresh rate of the display.
 ---
 ---Defaults to 60.
 ---@type number
 config.fps = 60
 
+---The approximate number of cells the window is split into by the renderer
+---to find out which regions changed between frames.
+---More cells mean less pixels are redrawn, at the cost of more hashing work.
+---
+---Defaults to 1024.
+---@type integer
+config.render_cell_count = 1024
+
+---The amount of memory, in bytes, used to keep rasterized glyphs around.
+---Glyphs that weren't drawn recently are dropped when this is exceeded.
+---
+---Defaults to 32MB.
+---@type integer
+config.glyph_cache_size = 32 * 1024 * 1024
+
 ---Maximum number of log items that will be stored.
 ---When the number of log items exceed this value, old items will be discarded.
 ---
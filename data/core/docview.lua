@@ -183,6 +183,9 @@ function DocView:get_col_x_offset(line, col)
       if column >= col then
         return xoffset
       end
+    elseif #text > 0 and font:is_monospace() and not text:find("[%c\128-\255]") then
+      -- every character has the same width
+      return xoffset + math.max(col - column, 0) * font:get_width(text) / length
     else
       for char in common.utf8_chars(text) do
         if column >= col then
@@ -214,6 +217,22 @@ function DocView:get_x_offset_col(line, x)
     if xoffset + width < x then
       xoffset = xoffset + width
       i = i + #text
+    elseif #text > 0 and font:is_monospace() and not text:find("[%c\128-\255]") then
+      -- every character has the same width, find the first one that starts
+      -- at or past x without going through them
+      local w = width / #text
+      local n = math.max(math.ceil((x - xoffset) / w), 0)
+      while n > 0 and xoffset + (n - 1) * w >= x do n = n - 1 end
+      while n < #text and xoffset + n * w < x do n = n + 1 end
+      if n < #text then
+        if n == 0 then
+          return (xoffset - x > w / 2) and last_i or i
+        end
+        return (xoffset + n * w - x > w / 2) and i + n - 1 or i + n
+      end
+      xoffset = xoffset + width
+      last_i = i + #text - 1
+      i = i + #text
     else
       for char in common.utf8_chars(text) do
         local w = font:get_width(char)
@@ -441,22 +460,11 @@ end
 
 
 function DocView:draw_line_text(line, x, y)
-  local default_font = self:get_font()
-  local tx, ty = x, y + self:get_line_text_y_offset()
-  local last_token = nil
   local tokens = self.doc.highlighter:get_line(line).tokens
-  local tokens_count = #tokens
-  if string.sub(tokens[tokens_count], -1) == "\n" then
-    last_token = tokens_count - 1
-  end
-  for tidx, type, text in self.doc.highlighter:each_token(line) do
-    local color = style.syntax[type]
-    local font = style.syntax_fonts[type] or default_font
-    -- do not render newline, fixes issue #1164
-    if tidx == last_token then text = text:sub(1, -2) end
-    tx = renderer.draw_text(font, text, tx, ty, color)
-    if tx > self.position.x + self.size.x then break end
-  end
+  -- the whole line is drawn in one call, which leaves out the newline at its
+  -- end (fixes issue #1164) and stops past the right edge of the view
+  renderer.draw_tokens(self:get_font(), tokens, style.syntax, x, y + self:get_line_text_y_offset(),
+    style.syntax_fonts, self.position.x + self.size.x)
   return self:get_line_height()
 end
 
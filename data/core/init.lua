@@ -68,6 +68,7 @@ end
 local function reload_customizations()
   local user_error = not core.load_user_directory()
   local project_error = not core.load_project_module()
+  common.convert_colors(style)
   if user_error or project_error then
     -- Use core.add_thread to delay opening the LogView, as opening
     -- it directly here disturbs the normal save operations.
@@ -789,6 +790,10 @@ function core.init()
   -- Load core plugins after user ones to let the user override them
   local plugins_success, plugins_refuse_list = core.load_plugins()
 
+  -- the colors the user module, the project module and plugins gave the
+  -- style are turned into color objects, which are faster to draw with
+  common.convert_colors(style)
+
   do
     local pdir, pname = project_dir_abs:match("(.*)[/\\\\](.*)")
     core.log("Opening project %q from directory %s", pname, pdir)
@@ -1088,6 +1093,8 @@ function core.reload_module(name)
     for k, v in pairs(new) do old[k] = v end
     package.loaded[name] = old
   end
+  -- color themes are switched by reloading them
+  common.convert_colors(style)
 end
 
 
@@ -1342,6 +1349,22 @@ function core.compose_window_title(title)
 end
 
 
+-- the renderer settings last passed to the renderer, they are applied again
+-- only when the config changes
+local applied_cell_count, applied_glyph_cache_size
+
+local function apply_renderer_config()
+  if config.render_cell_count ~= applied_cell_count then
+    renderer.set_cell_count(config.render_cell_count)
+    applied_cell_count = config.render_cell_count
+  end
+  if config.glyph_cache_size ~= applied_glyph_cache_size then
+    renderer.set_glyph_cache_size(config.glyph_cache_size)
+    applied_glyph_cache_size = config.glyph_cache_size
+  end
+end
+
+
 function core.step()
   -- handle events
   local did_keymap = false
@@ -1388,11 +1411,13 @@ function core.step()
   end
 
   -- draw
+  apply_renderer_config()
   renderer.begin_frame()
   core.clip_rect_stack[1] = { 0, 0, width, height }
   renderer.set_clip_rect(table.unpack(core.clip_rect_stack[1]))
   core.root_view:draw()
-  renderer.end_frame()
+  -- keep drawing until the text drawn without its glyphs is complete
+  if renderer.end_frame() then core.redraw = true end
   return true
 end
 
@@ -1438,13 +1463,15 @@ function core.run()
   local run_threads_full = 0
   while true do
     core.frame_start = system.get_time()
+    -- frames the display can't show are not worth drawing
+    local frame_time = 1 / math.min(config.fps, renderer.get_refresh_rate())
     local time_to_wake, threads_done = run_threads()
     if threads_done then
       run_threads_full = run_threads_full + 1
     end
     local did_redraw = false
     local did_step = false
-    local force_draw = core.redraw and last_frame_time and core.frame_start - last_frame_time > (1 / config.fps)
+    local force_draw = core.redraw and last_frame_time and core.frame_start - last_frame_time > frame_time
     if force_draw or not next_step or system.get_time() >= next_step then
       if core.step() then
         did_redraw = true
@@ -1455,14 +1482,21 @@ function core.run()
     end
     if core.restart_request or core.quit_request then break end
 
+    -- frames ending too soon after the last one are presented at the next
+    -- refresh of the display, we have to be awake by then
+    local present_time = renderer.present()
+    if present_time then
+      time_to_wake = math.min(time_to_wake, present_time)
+    end
+
     if not did_redraw then
-      if system.window_has_focus() or not did_step or run_threads_full < 2 then
+      if system.window_has_focus() or not did_step or run_threads_full < 2 or present_time then
         local now = system.get_time()
         if not next_step then -- compute the time until the next blink
           local t = now - core.blink_start
           local h = config.blink_period / 2
           local dt = math.ceil(t / h) * h - t
-          local cursor_time_to_wake = dt + 1 / config.fps
+          local cursor_time_to_wake = dt + frame_time
           next_step = now + cursor_time_to_wake
         end
         if system.wait_event(math.min(next_step - now, time_to_wake)) then
@@ -1476,7 +1510,7 @@ function core.run()
       run_threads_full = 0
       local now = system.get_time()
       local elapsed = now - core.frame_start
-      local next_frame = math.max(0, 1 / config.fps - elapsed)
+      local next_frame = math.max(0, frame_time - elapsed)
       next_step = next_step or (now + next_frame)
       system.sleep(math.min(next_frame, time_to_wake))
     end
@@ -589,7 +589,7 @@ local function draw_items(self, items, x, y, draw_fn)
   for _, item in ipairs(items) do
     if Object.is(item, renderer.font) then
       font = item
-    elseif type(item) == "table" then
+    elseif common.is_color(item) then
       color = item
     else
       x = draw_fn(font, color, item, nil, x, y, 0, self.size.y)
@@ -759,7 +759,7 @@ local function remove_spacing(self, styled_text)
   if
     not Object.is(styled_text[1], renderer.font)
     and
-    type(styled_text[1]) == "table"
+    common.is_color(styled_text[1])
     and
     (
       styled_text[2] == self.separator
@@ -774,7 +774,7 @@ local function remove_spacing(self, styled_text)
   if
     not Object.is(styled_text[#styled_text-1], renderer.font)
     and
-    type(styled_text[#styled_text-1]) == "table"
+    common.is_color(styled_text[#styled_text-1])
     and
     (
       styled_text[#styled_text] == self.separator
@@ -1146,6 +1146,7 @@ end
 function StatusView:draw()
   if not self.visible and self.size.y <= 0 then return end
 
+  renderer.begin_layer("statusview", self.position.x, self.position.y, self.size.x, self.size.y)
   self:draw_background(style.background2)
 
   if self.message and system.get_time() <= self.message_timeout then
@@ -1164,7 +1165,7 @@ function StatusView:draw()
         local item_x = self.left_xoffset + item.x + style.padding.x
         local hovered, item_bg = get_item_bg_color(self, item)
         if item.alignment == StatusView.Item.LEFT and not self.tooltip_mode then
-          if type(item_bg) == "table" then
+          if common.is_color(item_bg) then
             renderer.draw_rect(
               item_x, self.position.y,
               item.w, self.size.y, item_bg
@@ -1190,7 +1191,7 @@ function StatusView:draw()
         local item_x = self.right_xoffset + item.x + style.padding.x
         local hovered, item_bg = get_item_bg_color(self, item)
         if item.alignment == StatusView.Item.RIGHT then
-          if type(item_bg) == "table" then
+          if common.is_color(item_bg) then
             renderer.draw_rect(
               item_x, self.position.y,
               item.w, self.size.y, item_bg
@@ -1213,6 +1214,7 @@ function StatusView:draw()
       end
     end
   end
+  renderer.end_layer()
 end
 
 return StatusView
@@ -135,9 +135,11 @@ end
 
 
 function TitleView:draw()
+  renderer.begin_layer("titleview", self.position.x, self.position.y, self.size.x, self.size.y)
   self:draw_background(style.background2)
   self:draw_window_title()
   self:draw_window_controls()
+  renderer.end_layer()
 end
 
 return TitleView
@@ -9,11 +9,26 @@ renderer = {}
 ---Array of bytes that represents a color used by the rendering functions.
 ---Note: indexes for rgba are numerical 1 = r, 2 = g, 3 = b, 4 = a but for
 ---documentation purposes the letters r, g, b, a were used.
+---Colors can also be renderer.color objects, which the rendering functions
+---read without indexing a table. They are indexed like color tables, with
+---channels from 0 to 255.
 ---@class renderer.color
 ---@field public r number Red
 ---@field public g number Green
 ---@field public b number Blue
 ---@field public a number Alpha
+renderer.color = {}
+
+---
+---Create a color object from its channels or from a color.
+---
+---@param r number | renderer.color Red, or a color to copy
+---@param g? number Green
+---@param b? number Blue
+---@param a? number Alpha, 255 by default
+---
+---@return renderer.color
+function renderer.color.new(r, g, b, a) end
 
 ---
 ---Represent options that affect a font's rendering.
@@ -26,6 +41,29 @@ renderer = {}
 ---@field public smoothing boolean
 ---@field public strikethrough boolean
 
+---
+---What the renderer did to present the last frame.
+---@class renderer.framestats
+---@field public rects table<integer, table<integer, integer>> Presented regions as {x, y, width, height}
+---@field public rect_count integer Number of presented regions
+---@field public redrawn_area integer Area drawn again, in pixels
+---@field public scroll_dy integer Offset a scrolled region was moved by instead of redrawn, 0 if none
+---@field public command_count integer Draw commands issued during the frame
+---@field public command_bytes integer Bytes used in the command buffer
+---@field public text_bytes integer Bytes used by the text of the draw commands
+---@field public pending_glyphs integer Glyphs still being rasterized in the background
+
+---
+---Presentation counters, latencies are in seconds.
+---@class renderer.presentstats
+---@field public refresh_rate integer Refresh rate of the display showing the window, in Hz
+---@field public presents integer Number of times the window was presented
+---@field public coalesced integer Frames presented along with a later frame
+---@field public input_presents integer Presents showing the result of some input
+---@field public latency number Time the oldest frame of the last present waited for it
+---@field public input_latency number Time from the oldest input shown by the last such present to it
+---@field public avg_input_latency number Average of input_latency over all presents showing some input
+
 ---
 ---@class renderer.font
 renderer.font = {}
@@ -74,6 +112,14 @@ function renderer.font:set_tab_size(chars) end
 ---@return number
 function renderer.font:get_width(text) end
 
+---
+---Check if the font is monospace: all its printable ASCII characters have
+---the same width, so the width of text made of them is proportional to its
+---length. For a group of fonts, this is about the first one.
+---
+---@return boolean
+function renderer.font:is_monospace() end
+
 ---
 ---Get the height in pixels that occupies a single character
 ---when rendered with this font.
@@ -107,6 +153,61 @@ function renderer.font:get_path() end
 ---@param enable boolean
 function renderer.show_debug(enable) end
 
+---
+---Set the approximate number of cells the window is split into to find the
+---regions that changed between frames. The cell size is derived from this
+---and the window size: more cells mean less overdraw but more hashing work.
+---
+---@param count integer
+function renderer.set_cell_count(count) end
+
+---
+---Set the amount of memory, in bytes, the rasterized glyphs of all fonts may
+---use. Past it, the glyphs that weren't drawn recently are dropped at the end
+---of the frame and rasterized again when needed.
+---
+---@param size integer
+function renderer.set_glyph_cache_size(size) end
+
+---
+---Set the directory where the glyphs used by each font are saved when the
+---font is freed, to be read back the next time the same font is loaded
+---instead of being rasterized again. Only affects fonts loaded after the
+---call, nil disables it.
+---
+---@param path string?
+function renderer.set_font_cache_dir(path) end
+
+---
+---Get the regions that were updated on screen by the last call to
+---renderer.end_frame() along with some counters about the frame. A frame
+---identical to the previous one updates no region.
+---
+---@return renderer.framestats
+function renderer.get_frame_stats() end
+
+---
+---Present the frames ended by renderer.end_frame() that were held back
+---because they came less than a refresh interval after the previous present,
+---if that interval is over. Frames are presented at most once per refresh of
+---the display, those ending closer together are presented at once.
+---
+---@return number? time Seconds until the pending frames can be presented, nil if there are none left
+function renderer.present() end
+
+---
+---Get the refresh rate of the display showing the window, 60 if unknown.
+---
+---@return integer rate
+function renderer.get_refresh_rate() end
+
+---
+---Get counters about the presentation of frames and the latency between
+---them, or the input they show, and the moment they were presented.
+---
+---@return renderer.presentstats
+function renderer.get_present_stats() end
+
 ---
 ---Get the size of the screen area been rendered.
 ---
@@ -120,6 +221,12 @@ function renderer.begin_frame() end
 
 ---
 ---Tell the rendering system that we finished building the frame.
+---
+---Glyphs are rasterized in the background the first time they are drawn,
+---and text is drawn without them until they are ready. The regions drawn
+---that way are drawn again by a later frame once all glyphs are in.
+---
+---@return boolean redraw True if such regions are waiting for another frame
 function renderer.end_frame() end
 
 ---
@@ -131,6 +238,25 @@ function renderer.end_frame() end
 ---@param height number
 function renderer.set_clip_rect(x, y, width, height) end
 
+---
+---Start a retained layer: the drawing operations until renderer.end_layer()
+---are treated as a whole, and as long as they don't change, the pixels they
+---produced the last time are reused instead of drawing them again.
+---
+---The layer must paint all of its region with opaque colors, whatever was
+---below it when its pixels were kept is reused too. Layers can't be nested.
+---
+---@param id string Identifies the layer across frames
+---@param x number
+---@param y number
+---@param width number
+---@param height number
+function renderer.begin_layer(id, x, y, width, height) end
+
+---
+---End the layer started by renderer.begin_layer().
+function renderer.end_layer() end
+
 ---
 ---Draw a rectangle.
 ---
@@ -153,5 +279,24 @@ function renderer.draw_rect(x, y, width, height, color) end
 ---@return number x
 function renderer.draw_text(font, text, x, y, color) end
 
+---
+---Draw a line of highlighted tokens and return the x coordinate where the
+---last token finished drawing. The tokens are in the format produced by the
+---tokenizer, a type followed by its text. Each token is drawn with the color
+---of its type and with the font of its type in `fonts`, or `font` if it has
+---none. A newline at the end of the last token isn't drawn, and no more
+---tokens are drawn once one finishes past `max_x`.
+---
+---@param font renderer.font
+---@param tokens string[]
+---@param colors table<string, renderer.color>
+---@param x number
+---@param y number
+---@param fonts? table<string, renderer.font>
+---@param max_x? number
+---
+---@return number x
+function renderer.draw_tokens(font, tokens, colors, x, y, fonts, max_x) end
+
 
 return renderer
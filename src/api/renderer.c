@@ -1,4 +1,5 @@
 #include <string.h>
+#include <math.h>
 #include "api.h"
 #include "../renderer.h"
 #include "../rencache.h"
@@ -7,6 +8,12 @@
 // a reference index to a table that stores the fonts
 static int RENDERER_FONT_REF = LUA_NOREF;
 
+// the metatable of colors, compared to tell them from tables without a lookup
+static const void *color_metatable = NULL;
+
+// the number of token types draw_tokens remembers the style of in one call
+#define TOKEN_STYLES_MAX 16
+
 static int font_get_options(
   lua_State *L,
   ERenFontAntialiasing *antialiasing,
@@ -202,6 +209,12 @@ static int f_font_get_width(lua_State *L) {
   return 1;
 }
 
+static int f_font_is_monospace(lua_State *L) {
+  RenFont* fonts[FONT_FALLBACK_MAX]; font_retrieve(L, fonts, 1);
+  lua_pushboolean(L, ren_font_group_is_monospace(fonts));
+  return 1;
+}
+
 static int f_font_get_height(lua_State *L) {
   RenFont* fonts[FONT_FALLBACK_MAX]; font_retrieve(L, fonts, 1);
   lua_pushnumber(L, ren_font_group_get_height(fonts));
@@ -257,6 +270,13 @@ static RenColor checkcolor(lua_State *L, int idx, int def) {
   if (lua_isnoneornil(L, idx)) {
     return (RenColor) { def, def, def, 255 };
   }
+  // colors made with renderer.color.new are read without looking up each channel
+  if (lua_type(L, idx) == LUA_TUSERDATA && lua_getmetatable(L, idx)) {
+    bool is_color = lua_topointer(L, -1) == color_metatable;
+    lua_pop(L, 1);
+    if (is_color)
+      return *(RenColor*) lua_touserdata(L, idx);
+  }
   luaL_checktype(L, idx, LUA_TTABLE);
   color.r = get_color_value(L, idx, 1);
   color.g = get_color_value(L, idx, 2);
@@ -266,6 +286,64 @@ static RenColor checkcolor(lua_State *L, int idx, int def) {
   return color;
 }
 
+// the channel of a color at an index, 1 to 4 for red, green, blue and alpha
+static uint8_t* color_channel(RenColor *color, lua_Integer index) {
+  switch (index) {
+    case 1: return &color->r;
+    case 2: return &color->g;
+    case 3: return &color->b;
+    case 4: return &color->a;
+    default: return NULL;
+  }
+}
+
+static int f_color_new(lua_State *L) {
+  RenColor color;
+  if (lua_type(L, 1) == LUA_TNUMBER) {
+    color.r = (int) luaL_checknumber(L, 1);
+    color.g = (int) luaL_checknumber(L, 2);
+    color.b = (int) luaL_checknumber(L, 3);
+    color.a = (int) luaL_optnumber(L, 4, 255);
+  } else {
+    luaL_checkany(L, 1);
+    color = checkcolor(L, 1, 0);
+  }
+  RenColor *self = lua_newuserdata(L, sizeof(RenColor));
+  *self = color;
+  luaL_setmetatable(L, API_TYPE_COLOR);
+  return 1;
+}
+
+static int f_color_index(lua_State *L) {
+  RenColor *self = luaL_checkudata(L, 1, API_TYPE_COLOR);
+  int is_integer;
+  lua_Integer index = lua_tointegerx(L, 2, &is_integer);
+  uint8_t *channel = is_integer ? color_channel(self, index) : NULL;
+  if (channel)
+    lua_pushinteger(L, *channel);
+  else
+    lua_pushnil(L);
+  return 1;
+}
+
+static int f_color_newindex(lua_State *L) {
+  RenColor *self = luaL_checkudata(L, 1, API_TYPE_COLOR);
+  int is_integer;
+  lua_Integer index = lua_tointegerx(L, 2, &is_integer);
+  uint8_t *channel = is_integer ? color_channel(self, index) : NULL;
+  luaL_argcheck(L, channel != NULL, 2, "color channel expected, from 1 to 4");
+  // wrapped like the channels of color tables
+  *channel = (int) luaL_checknumber(L, 3);
+  return 0;
+}
+
+static int f_color_len(lua_State *L) {
+  luaL_checkudata(L, 1, API_TYPE_COLOR);
+  lua_pushinteger(L, 4);
+  return 1;
+}
+
+
 
 static int f_show_debug(lua_State *L) {
   luaL_checkany(L, 1);
@@ -274,6 +352,59 @@ static int f_show_debug(lua_State *L) {
 }
 
 
+static int f_set_cell_count(lua_State *L) {
+  int count = luaL_checknumber(L, 1);
+  rencache_set_cell_count(count);
+  return 0;
+}
+
+
+static int f_set_glyph_cache_size(lua_State *L) {
+  lua_Number size = luaL_checknumber(L, 1);
+  luaL_argcheck(L, size >= 0, 1, "size must be positive");
+  ren_set_glyph_cache_size((size_t) size);
+  return 0;
+}
+
+
+static int f_set_font_cache_dir(lua_State *L) {
+  ren_set_font_cache_dir(luaL_optstring(L, 1, NULL));
+  return 0;
+}
+
+
+static int f_get_frame_stats(lua_State *L) {
+  RenFrameStats stats;
+  rencache_get_frame_stats(&stats);
+  lua_createtable(L, 0, 7);
+  lua_createtable(L, stats.rect_count, 0);
+  for (int i = 0; i < stats.rect_count; i++) {
+    lua_createtable(L, 4, 0);
+    lua_pushinteger(L, stats.rects[i].x);      lua_rawseti(L, -2, 1);
+    lua_pushinteger(L, stats.rects[i].y);      lua_rawseti(L, -2, 2);
+    lua_pushinteger(L, stats.rects[i].width);  lua_rawseti(L, -2, 3);
+    lua_pushinteger(L, stats.rects[i].height); lua_rawseti(L, -2, 4);
+    lua_rawseti(L, -2, i + 1);
+  }
+  lua_setfield(L, -2, "rects");
+  lua_pushinteger(L, stats.rect_count);
+  lua_setfield(L, -2, "rect_count");
+  lua_pushinteger(L, stats.redrawn_area);
+  lua_setfield(L, -2, "redrawn_area");
+  lua_pushinteger(L, stats.scroll_dy);
+  lua_setfield(L, -2, "scroll_dy");
+  lua_pushinteger(L, stats.command_count);
+  lua_setfield(L, -2, "command_count");
+  lua_pushinteger(L, stats.command_bytes);
+  lua_setfield(L, -2, "command_bytes");
+  lua_pushinteger(L, stats.text_bytes);
+  lua_setfield(L, -2, "text_bytes");
+  lua_pushinteger(L, stats.pending_glyphs);
+  lua_setfield(L, -2, "pending_glyphs");
+  return 1;
+}
+
+
 static int f_get_size(lua_State *L) {
   int w, h;
   ren_get_size(window_renderer, &w, &h);
@@ -290,11 +421,51 @@ static int f_begin_frame(UNUSED lua_State *L) {
 
 
 static int f_end_frame(UNUSED lua_State *L) {
-  rencache_end_frame(window_renderer);
+  bool redraw = rencache_end_frame(window_renderer);
   // clear the font reference table
   lua_newtable(L);
   lua_rawseti(L, LUA_REGISTRYINDEX, RENDERER_FONT_REF);
-  return 0;
+  lua_pushboolean(L, redraw);
+  return 1;
+}
+
+
+static int f_present(lua_State *L) {
+  double wait = ren_present(window_renderer);
+  if (wait <= 0) {
+    lua_pushnil(L);
+  } else {
+    lua_pushnumber(L, wait);
+  }
+  return 1;
+}
+
+
+static int f_get_refresh_rate(lua_State *L) {
+  lua_pushinteger(L, ren_get_refresh_rate());
+  return 1;
+}
+
+
+static int f_get_present_stats(lua_State *L) {
+  RenPresentStats stats;
+  ren_get_present_stats(&stats);
+  lua_createtable(L, 0, 7);
+  lua_pushinteger(L, stats.refresh_rate);
+  lua_setfield(L, -2, "refresh_rate");
+  lua_pushinteger(L, stats.presents);
+  lua_setfield(L, -2, "presents");
+  lua_pushinteger(L, stats.coalesced);
+  lua_setfield(L, -2, "coalesced");
+  lua_pushinteger(L, stats.input_presents);
+  lua_setfield(L, -2, "input_presents");
+  lua_pushnumber(L, stats.latency);
+  lua_setfield(L, -2, "latency");
+  lua_pushnumber(L, stats.input_latency);
+  lua_setfield(L, -2, "input_latency");
+  lua_pushnumber(L, stats.avg_input_latency);
+  lua_setfield(L, -2, "avg_input_latency");
+  return 1;
 }
 
 
@@ -316,6 +487,26 @@ static int f_set_clip_rect(lua_State *L) {
 }
 
 
+static int f_begin_layer(lua_State *L) {
+  const char *id = luaL_checkstring(L, 1);
+  lua_Number x = luaL_checknumber(L, 2);
+  lua_Number y = luaL_checknumber(L, 3);
+  lua_Number w = luaL_checknumber(L, 4);
+  lua_Number h = luaL_checknumber(L, 5);
+  RenRect rect = rect_to_grid(x, y, w, h);
+  if (!rencache_begin_layer(window_renderer, id, rect))
+    return luaL_error(L, "layers can't be nested");
+  return 0;
+}
+
+
+static int f_end_layer(lua_State *L) {
+  if (!rencache_end_layer(window_renderer))
+    return luaL_error(L, "no layer to end");
+  return 0;
+}
+
+
 static int f_draw_rect(lua_State *L) {
   lua_Number x = luaL_checknumber(L, 1);
   lua_Number y = luaL_checknumber(L, 2);
@@ -327,21 +518,26 @@ static int f_draw_rect(lua_State *L) {
   return 0;
 }
 
-static int f_draw_text(lua_State *L) {
-  RenFont* fonts[FONT_FALLBACK_MAX];
-  font_retrieve(L, fonts, 1);
-
-  // stores a reference to this font to the reference table
+// stores a reference to the font at idx in the reference table, so that it
+// stays alive until the end of the frame
+static void font_reference(lua_State *L, int idx) {
+  idx = lua_absindex(L, idx);
   lua_rawgeti(L, LUA_REGISTRYINDEX, RENDERER_FONT_REF);
   if (lua_istable(L, -1))
   {
-    lua_pushvalue(L, 1);
+    lua_pushvalue(L, idx);
     lua_pushboolean(L, 1);
     lua_rawset(L, -3);
   } else {
     fprintf(stderr, "warning: failed to reference count fonts\n");
   }
   lua_pop(L, 1);
+}
+
+static int f_draw_text(lua_State *L) {
+  RenFont* fonts[FONT_FALLBACK_MAX];
+  font_retrieve(L, fonts, 1);
+  font_reference(L, 1);
 
   size_t len;
   const char *text = luaL_checklstring(L, 2, &len);
@@ -353,14 +549,84 @@ static int f_draw_text(lua_State *L) {
   return 1;
 }
 
+// the font and color of a token type; types are short strings, which Lua
+// interns, so they can be told apart by their address
+typedef struct {
+  const char *type;
+  RenFont* fonts[FONT_FALLBACK_MAX];
+  RenColor color;
+} TokenStyle;
+
+static int f_draw_tokens(lua_State *L) {
+  RenFont* default_fonts[FONT_FALLBACK_MAX];
+  font_retrieve(L, default_fonts, 1);
+  font_reference(L, 1);
+  luaL_checktype(L, 2, LUA_TTABLE);
+  luaL_checktype(L, 3, LUA_TTABLE);
+  double x = luaL_checknumber(L, 4);
+  int y = luaL_checknumber(L, 5);
+  bool syntax_fonts = !lua_isnoneornil(L, 6);
+  if (syntax_fonts)
+    luaL_checktype(L, 6, LUA_TTABLE);
+  double max_x = luaL_optnumber(L, 7, HUGE_VAL);
+
+  TokenStyle styles[TOKEN_STYLES_MAX];
+  int style_count = 0;
+  int count = lua_rawlen(L, 2);
+  for (int i = 1; i < count && x <= max_x; i += 2) {
+    lua_rawgeti(L, 2, i);
+    lua_rawgeti(L, 2, i + 1);
+    size_t len;
+    const char *type = lua_tostring(L, -2);
+    const char *text = lua_tolstring(L, -1, &len);
+    if (!type || !text)
+      return luaL_error(L, "invalid token at index %d", i);
+    // the newline at the end of the line isn't drawn
+    if (i + 1 == count && len > 0 && text[len - 1] == '\n')
+      len--;
+
+    TokenStyle *style = NULL;
+    for (int j = 0; j < style_count && !style; j++) {
+      if (styles[j].type == type)
+        style = &styles[j];
+    }
+    if (!style) {
+      style = &styles[style_count < TOKEN_STYLES_MAX ? style_count++ : TOKEN_STYLES_MAX - 1];
+      style->type = type;
+      memcpy(style->fonts, default_fonts, sizeof(default_fonts));
+      if (syntax_fonts && lua_getfield(L, 6, type) != LUA_TNIL) {
+        font_retrieve(L, style->fonts, lua_gettop(L));
+        font_reference(L, -1);
+      }
+      lua_getfield(L, 3, type);
+      style->color = checkcolor(L, lua_gettop(L), 255);
+      lua_pop(L, syntax_fonts ? 2 : 1);
+    }
+    x = rencache_draw_text(window_renderer, style->fonts, text, len, x, y, style->color);
+    lua_pop(L, 2);
+  }
+  lua_pushnumber(L, x);
+  return 1;
+}
+
 static const luaL_Reg lib[] = {
   { "show_debug",         f_show_debug         },
+  { "set_cell_count",     f_set_cell_count     },
+  { "set_glyph_cache_size", f_set_glyph_cache_size },
+  { "set_font_cache_dir", f_set_font_cache_dir },
+  { "get_frame_stats",    f_get_frame_stats    },
   { "get_size",           f_get_size           },
   { "begin_frame",        f_begin_frame        },
   { "end_frame",          f_end_frame          },
+  { "present",            f_present            },
+  { "get_refresh_rate",   f_get_refresh_rate   },
+  { "get_present_stats",  f_get_present_stats  },
   { "set_clip_rect",      f_set_clip_rect      },
+  { "begin_layer",        f_begin_layer        },
+  { "end_layer",          f_end_layer          },
   { "draw_rect",          f_draw_rect          },
   { "draw_text",          f_draw_text          },
+  { "draw_tokens",        f_draw_tokens        },
   { NULL,                 NULL                 }
 };
 
@@ -371,6 +637,7 @@ static const luaL_Reg fontLib[] = {
   { "group",              f_font_group              },
   { "set_tab_size",       f_font_set_tab_size       },
   { "get_width",          f_font_get_width          },
+  { "is_monospace",       f_font_is_monospace       },
   { "get_height",         f_font_get_height         },
   { "get_size",           f_font_get_size           },
   { "set_size",           f_font_set_size           },
@@ -378,6 +645,14 @@ static const luaL_Reg fontLib[] = {
   { NULL, NULL }
 };
 
+static const luaL_Reg colorLib[] = {
+  { "__index",            f_color_index             },
+  { "__newindex",         f_color_newindex          },
+  { "__len",              f_color_len               },
+  { "new",                f_color_new               },
+  { NULL, NULL }
+};
+
 int luaopen_renderer(lua_State *L) {
   // gets a reference on the registry to store font data
   lua_newtable(L);
@@ -389,5 +664,9 @@ int luaopen_renderer(lua_State *L) {
   lua_pushvalue(L, -1);
   lua_setfield(L, -2, "__index");
   lua_setfield(L, -2, "font");
+  luaL_newmetatable(L, API_TYPE_COLOR);
+  luaL_setfuncs(L, colorLib, 0);
+  color_metatable = lua_topointer(L, -1);
+  lua_setfield(L, -2, "color");
   return 1;
 }
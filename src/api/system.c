@@ -179,6 +179,13 @@ top:
     return 0;
   }
 
+  /* keyboard, text and mouse events, to measure how long their results take
+  ** to be presented */
+  if ((e.type >= SDL_KEYDOWN && e.type < SDL_JOYAXISMOTION)
+      || (e.type >= SDL_FINGERDOWN && e.type <= SDL_FINGERMOTION)) {
+    ren_input_received(e.common.timestamp);
+  }
+
   switch (e.type) {
     case SDL_QUIT:
       lua_pushstring(L, "quit");
@@ -209,6 +216,20 @@ top:
         lua_pushstring(L, "mouseleft");
         return 1;
       }
+#if SDL_VERSION_ATLEAST(2, 0, 18)
+      if (e.window.event == SDL_WINDOWEVENT_DISPLAY_CHANGED) {
+        /* the new display may have another refresh rate or scale, so the
+        ** window is drawn again like after a resize */
+        int w, h;
+        ren_resize_window(window_renderer);
+        rencache_invalidate();
+        ren_get_size(window_renderer, &w, &h);
+        lua_pushstring(L, "resized");
+        lua_pushinteger(L, w);
+        lua_pushinteger(L, h);
+        return 3;
+      }
+#endif
       if (e.window.event == SDL_WINDOWEVENT_FOCUS_LOST) {
         lua_pushstring(L, "focuslost");
         return 1;
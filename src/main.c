@@ -264,6 +264,7 @@ init_lua:
 
   // This allows the window to be destroyed before lite-xl is done with
   // reaping child processes
+  rencache_shutdown();
   ren_free(window_renderer);
   lua_close(L);
 
@@ -1,8 +1,10 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
+#include <math.h>
 
 #ifdef _MSC_VER
   #ifndef alignof
@@ -11,6 +13,7 @@
   /* max_align_t is a compiler defined type, but
   ** MSVC doesn't provide it, so we'll have to improvise */
   typedef long double max_align_t;
+  #include <intrin.h>
 #else
   #include <stdalign.h>
 #endif
@@ -24,14 +27,32 @@
 ** of hash values, take the cells that have changed since the previous frame,
 ** merge them into dirty rectangles and redraw only those regions */
 
-#define CELLS_X 80
-#define CELLS_Y 50
-#define CELL_SIZE 96
-#define CMD_BUF_RESIZE_RATE 1.2
+/* the cell size is derived from the window size so that the grid has about
+** cell_count cells, more cells mean less overdraw but more hashing */
+#define DEFAULT_CELL_COUNT 1024
+#define MIN_CELL_SIZE 16
+#define MAX_CELL_SIZE 256
+/* two dirty rects are merged only if their union isn't much larger than them */
+#define MERGE_MAX_COST 1.5
+/* above this many rects the merge sweeps are skipped */
+#define MERGE_MAX_RECTS 128
+#define CMD_BUF_RESIZE_RATE 2
 #define CMD_BUF_INIT_SIZE (1024 * 512)
+#define TEXT_POOL_INIT_SIZE (1024 * 64)
 #define COMMAND_BARE_SIZE offsetof(Command, command)
+#define MAX_RENDER_THREADS 8
+/* frames whose dirty area (in points) is below this are drawn on the main thread */
+#define PARALLEL_MIN_AREA (512 * 512)
+/* a clip region is considered scrolled when at least this many text commands
+** moved by the same amount, and they are at least half of its text commands */
+#define SCROLL_MIN_MATCHES 8
+#define SCROLL_MAX_VOTES 64
+/* retained layers kept at once, the least recently used one is dropped */
+#define MAX_LAYERS 32
+/* beyond this, the rects waiting for glyphs are merged into one */
+#define MAX_RETRY_RECTS 64
 
-enum CommandType { SET_CLIP, DRAW_TEXT, DRAW_RECT };
+enum CommandType { SET_CLIP, DRAW_TEXT, DRAW_RECT, BEGIN_LAYER, END_LAYER };
 
 typedef struct {
   enum CommandType type;
@@ -51,8 +72,11 @@ typedef struct {
   RenFont *fonts[FONT_FALLBACK_MAX];
   float text_x;
   size_t len;
+  unsigned text_hash;
   int8_t tab_size;
-  char text[];
+  /* the text lives in the text pool, interned. The offset depends on the
+  ** strings drawn before, so it's left out of the command key */
+  size_t text_offset;
 } DrawTextCommand;
 
 typedef struct {
@@ -60,33 +84,241 @@ typedef struct {
   RenColor color;
 } DrawRectCommand;
 
-static unsigned cells_buf1[CELLS_X * CELLS_Y];
-static unsigned cells_buf2[CELLS_X * CELLS_Y];
-static unsigned *cells_prev = cells_buf1;
-static unsigned *cells = cells_buf2;
-static RenRect rect_buf[CELLS_X * CELLS_Y / 2];
+typedef struct {
+  RenRect rect;
+  /* index in layers, -1 when no slot was free and the layer isn't cached */
+  int layer;
+} BeginLayerCommand;
+
+static int cell_count = DEFAULT_CELL_COUNT;
+static int cell_size, cells_x, cells_y;
+static unsigned *cells_prev;
+static unsigned *cells;
+static RenRect *rect_buf;
+
+/* retained layers: the commands between BEGIN_LAYER and END_LAYER are hashed
+** as a whole into the cells of the layer rect, and when any of them has to be
+** redrawn the pixels kept from the last time the layer changed are copied
+** back instead of replaying its commands. Layers must be opaque, the pixels
+** below them are part of the copy. */
+typedef struct {
+  char *id;
+  unsigned key;
+  /* visible part of the layer when its pixels were kept, in points */
+  RenRect rect;
+  uint8_t *pixels;
+  int pitch, bytes_per_pixel;
+  float scale;
+  bool rebuild;
+  unsigned last_used;
+  /* the commands of the layer in this frame */
+  Command *commands, *commands_end;
+} Layer;
+
+static Layer layers[MAX_LAYERS];
+static unsigned layer_frame;
+static bool layer_open;
+
+/* the text of the frame's commands, each distinct string is stored once and
+** found again through a hash table whose entries are stamped with the frame
+** they were added in, so that it doesn't need to be cleared between frames */
+typedef struct {
+  unsigned hash, frame;
+  size_t len, offset;
+} TextEntry;
+
+static struct {
+  char *data;
+  size_t idx, size;
+  TextEntry *entries;
+  int entry_count, entry_capacity;
+  unsigned frame;
+} text_pool;
+/* indices of the rects ending on the previous and the current row */
+static int *open_rects;
+
+/* spatial index of the frame, built while hashing: every drawing command
+** gets an ordinal and is linked into the bucket of each cell it overlaps, so
+** that a dirty rect only replays the commands of the cells it covers */
+typedef struct {
+  Command *cmd;
+  RenRect clip;
+  /* kept to compare with the next frame, the command buffer is reused */
+  RenRect rect;
+  unsigned key;
+  enum CommandType type;
+} IndexedCommand;
+
+typedef struct {
+  int command;
+  int next;
+} CellEntry;
+
+static int *cell_heads;
+static IndexedCommand *indexed_commands;
+static int indexed_count, indexed_capacity;
+/* set when the index couldn't grow, the frame then replays the whole command
+** buffer in each rect as it did without an index */
+static bool index_incomplete;
+static Command *frame_commands, *frame_commands_end;
+
+/* the indexed commands of the previous frame and a hash table over their keys,
+** used to detect regions that were only translated vertically since then */
+static IndexedCommand *prev_commands;
+static int prev_count, prev_capacity;
+static bool prev_commands_valid;
+static int *match_heads, *match_next;
+static int match_size, match_heads_capacity, match_next_capacity;
+static uint64_t *matched;
+static int matched_capacity;
+
+typedef struct {
+  RenRect clip;
+  int dy, count;
+} ScrollVote;
+
+/* the command buffer of the previous frame, swapped with the one of the window
+** at the end of each frame, and the key of each of its commands: leading
+** commands that didn't change since then don't need to be hashed again */
+static uint8_t *prev_command_buf;
+static size_t prev_command_buf_idx, prev_command_buf_size;
+static unsigned *command_keys, *prev_command_keys;
+static int command_keys_capacity, prev_command_keys_capacity, prev_command_keys_count;
+
+enum { CELL_TRACKED, CELL_SCROLLED, CELL_DAMAGED };
+/* per cell state while a scroll is being handled */
+static uint8_t *scroll_cells;
+static CellEntry *cell_entries;
+static int cell_entry_count, cell_entry_capacity;
 static bool resize_issue;
 static RenRect screen_rect;
 static RenRect last_clip_rect;
 static bool show_debug;
+/* kept for rencache_get_frame_stats, rect_buf is reused by the next frame */
+static RenFrameStats frame_stats;
+static RenRect *frame_rects;
+static int frame_rects_capacity;
+/* rects drawn while some of their glyphs were still being rasterized, they
+** are drawn again once the glyph rasterizer has caught up */
+static RenRect retry_rects[MAX_RETRY_RECTS];
+static int retry_count;
+
+/* the dirty rects of a frame are split in horizontal bands, one per thread.
+** Bands never overlap, so every thread owns the pixels it writes; each one
+** draws through its own surface aliasing the window pixels so that it can
+** hold a separate clip rect. */
+typedef struct {
+  SDL_Thread *thread;
+  SDL_sem *start;
+  RenSurface rs;
+  RenRect band;
+  /* one bit per indexed command, set for those overlapping the drawn rect */
+  uint64_t *marks;
+  size_t marks_capacity;
+} RenderWorker;
+
+static struct {
+  RenderWorker workers[MAX_RENDER_THREADS];
+  int count;
+  bool initialized, quit;
+  SDL_sem *done;
+  int rect_count;
+} pool;
+static RenderWorker main_worker;
 
 static inline int rencache_min(int a, int b) { return a < b ? a : b; }
 static inline int rencache_max(int a, int b) { return a > b ? a : b; }
 
 
-/* 32bit fnv-1a hash */
+/* the value of an untouched cell */
 #define HASH_INITIAL 2166136261
 
-static void hash(unsigned *h, const void *data, int size) {
-  const unsigned char *p = data;
-  while (size--) {
-    *h = (*h ^ *p++) * 16777619;
+/* 64bit word-at-a-time hash in the spirit of xxHash64: commands are padded to
+** max_align_t, so they are processed as four independent lanes of 64bit words
+** which the compiler can interleave or vectorize */
+#define HASH_PRIME1 0x9E3779B185EBCA87ULL
+#define HASH_PRIME2 0xC2B2AE3D27D4EB4FULL
+#define HASH_PRIME3 0x165667B19E3779F9ULL
+
+static inline uint64_t hash_rotl(uint64_t x, int r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t hash_round(uint64_t acc, uint64_t word) {
+  return hash_rotl(acc + word * HASH_PRIME2, 31) * HASH_PRIME1;
+}
+
+static inline uint64_t hash_read(const unsigned char *p) {
+  uint64_t word;
+  memcpy(&word, p, sizeof(word));
+  return word;
+}
+
+static unsigned hash(const void *data, size_t size) {
+  const unsigned char *p = data, *end = p + size;
+  uint64_t h;
+  if (size >= 32) {
+    uint64_t v1 = HASH_PRIME1 + HASH_PRIME2, v2 = HASH_PRIME2, v3 = 0, v4 = -HASH_PRIME1;
+    for (; p + 32 <= end; p += 32) {
+      v1 = hash_round(v1, hash_read(p));
+      v2 = hash_round(v2, hash_read(p + 8));
+      v3 = hash_round(v3, hash_read(p + 16));
+      v4 = hash_round(v4, hash_read(p + 24));
+    }
+    h = hash_rotl(v1, 1) + hash_rotl(v2, 7) + hash_rotl(v3, 12) + hash_rotl(v4, 18);
+  } else {
+    h = HASH_PRIME3;
+  }
+  h += size;
+  for (; p + 8 <= end; p += 8) {
+    h = hash_rotl(h ^ hash_round(0, hash_read(p)), 27) * HASH_PRIME1 + HASH_PRIME3;
   }
+  for (; p < end; p++) {
+    h = hash_rotl(h ^ (*p * HASH_PRIME3), 11) * HASH_PRIME1;
+  }
+  /* avalanche and fold to the size of a cell */
+  h ^= h >> 33;
+  h *= HASH_PRIME2;
+  h ^= h >> 29;
+  h *= HASH_PRIME3;
+  h ^= h >> 32;
+  return (unsigned) h;
+}
+
+/* order dependent combination of the command hashes that overlap a cell */
+static inline void hash_combine(unsigned *cell, unsigned h) {
+  *cell = (*cell ^ h) * 16777619;
+}
+
+
+/* hash of a command without its vertical position, so that commands which
+** only moved vertically between frames can be matched */
+static unsigned command_key(Command *cmd) {
+  RenRect r = cmd->command[0];
+  size_t size = cmd->type == DRAW_TEXT
+    ? offsetof(DrawTextCommand, text_offset) : cmd->size - COMMAND_BARE_SIZE;
+  unsigned key = hash((const char*) cmd->command + sizeof(RenRect), size - sizeof(RenRect));
+  hash_combine(&key, cmd->type);
+  hash_combine(&key, r.x);
+  hash_combine(&key, r.width);
+  hash_combine(&key, r.height);
+  return key;
 }
 
 
 static inline int cell_idx(int x, int y) {
-  return x + y * CELLS_X;
+  return x + y * cells_x;
+}
+
+
+static inline int lowest_bit(uint64_t v) {
+#ifdef _MSC_VER
+  unsigned long idx;
+  _BitScanForward64(&idx, v);
+  return (int) idx;
+#else
+  return __builtin_ctzll(v);
+#endif
 }
 
 
@@ -113,6 +345,11 @@ static RenRect merge_rects(RenRect a, RenRect b) {
   return (RenRect) { x1, y1, x2 - x1, y2 - y1 };
 }
 
+static inline bool same_rect(RenRect a, RenRect b) {
+  return a.x == b.x && a.y == b.y && a.width == b.width && a.height == b.height;
+}
+
+
 static bool expand_command_buffer(RenWindow *window_renderer) {
   size_t new_size = window_renderer->command_buf_size * CMD_BUF_RESIZE_RATE;
   if (new_size == 0) {
@@ -154,6 +391,71 @@ static void* push_command(RenWindow *window_renderer, enum CommandType type, int
 }
 
 
+static void reset_text_pool(void) {
+  text_pool.idx = 0;
+  text_pool.entry_count = 0;
+  if (++text_pool.frame == 0) {
+    /* the stamps wrapped around, old entries would look current */
+    if (text_pool.entries) {
+      memset(text_pool.entries, 0, text_pool.entry_capacity * sizeof(TextEntry));
+    }
+    text_pool.frame = 1;
+  }
+}
+
+
+static bool grow_text_entries(void) {
+  int capacity = text_pool.entry_capacity ? text_pool.entry_capacity * 2 : 1024;
+  TextEntry *entries = calloc(capacity, sizeof(TextEntry));
+  if (!entries) { return false; }
+  for (int i = 0; i < text_pool.entry_capacity; i++) {
+    TextEntry *e = &text_pool.entries[i];
+    if (e->frame != text_pool.frame) { continue; }
+    int slot = e->hash & (capacity - 1);
+    while (entries[slot].frame == text_pool.frame) { slot = (slot + 1) & (capacity - 1); }
+    entries[slot] = *e;
+  }
+  free(text_pool.entries);
+  text_pool.entries = entries;
+  text_pool.entry_capacity = capacity;
+  return true;
+}
+
+
+static bool intern_text(const char *text, size_t len, size_t *offset, unsigned *text_hash) {
+  if (text_pool.entry_count * 2 >= text_pool.entry_capacity && !grow_text_entries()) {
+    return false;
+  }
+  unsigned h = hash(text, len);
+  int mask = text_pool.entry_capacity - 1, slot = h & mask;
+  for (; text_pool.entries[slot].frame == text_pool.frame; slot = (slot + 1) & mask) {
+    TextEntry *e = &text_pool.entries[slot];
+    if (e->hash == h && e->len == len && memcmp(text_pool.data + e->offset, text, len) == 0) {
+      *offset = e->offset;
+      *text_hash = h;
+      return true;
+    }
+  }
+  size_t needed = text_pool.idx + len + 1;
+  if (needed > text_pool.size) {
+    size_t new_size = text_pool.size ? text_pool.size : TEXT_POOL_INIT_SIZE;
+    while (new_size < needed) { new_size *= 2; }
+    char *new_data = realloc(text_pool.data, new_size);
+    if (!new_data) { return false; }
+    text_pool.data = new_data;
+    text_pool.size = new_size;
+  }
+  memcpy(text_pool.data + text_pool.idx, text, len);
+  text_pool.data[text_pool.idx + len] = '\0';
+  text_pool.entries[slot] = (TextEntry) { h, text_pool.frame, len, text_pool.idx };
+  text_pool.entry_count++;
+  *offset = text_pool.idx;
+  *text_hash = h;
+  text_pool.idx = needed;
+  return true;
+}
+
+
 static bool next_command(RenWindow *window_renderer, Command **prev) {
   if (*prev == NULL) {
     *prev = (Command*) window_renderer->command_buf;
@@ -164,6 +466,26 @@ static bool next_command(RenWindow *window_renderer, Command **prev) {
 }
 
 
+/* counts the leading commands that are byte identical to the ones of the
+** previous frame, and whether the whole buffer is */
+static int unchanged_command_count(RenWindow *window_renderer, bool *identical) {
+  *identical = false;
+  if (!prev_commands_valid || resize_issue) { return 0; }
+  size_t offset = 0, size = window_renderer->command_buf_idx;
+  size_t common = size < prev_command_buf_idx ? size : prev_command_buf_idx;
+  int count = 0;
+  while (offset < common) {
+    Command *cmd = (Command*) (window_renderer->command_buf + offset);
+    Command *prev = (Command*) (prev_command_buf + offset);
+    if (cmd->size != prev->size || memcmp(cmd, prev, cmd->size) != 0) { break; }
+    offset += cmd->size;
+    count++;
+  }
+  *identical = offset == size && size == prev_command_buf_idx;
+  return rencache_min(count, prev_command_keys_count);
+}
+
+
 void rencache_show_debug(bool enable) {
   show_debug = enable;
 }
@@ -194,11 +516,19 @@ double rencache_draw_text(RenWindow *window_renderer, RenFont **fonts, const cha
   int x_offset;
   double width = ren_font_group_get_width(window_renderer, fonts, text, len, &x_offset);
   RenRect rect = { x + x_offset, y, (int)(width - x_offset), ren_font_group_get_height(fonts) };
+  size_t text_offset;
+  unsigned text_hash;
   if (rects_overlap(last_clip_rect, rect)) {
-    int sz = len + 1;
-    DrawTextCommand *cmd = push_command(window_renderer, DRAW_TEXT, sizeof(DrawTextCommand) + sz);
+    if (resize_issue) { return x + width; }
+    if (!intern_text(text, len, &text_offset, &text_hash)) {
+      fprintf(stderr, "Warning: (" __FILE__ "): unable to resize text pool\n");
+      resize_issue = true;
+      return x + width;
+    }
+    DrawTextCommand *cmd = push_command(window_renderer, DRAW_TEXT, sizeof(DrawTextCommand));
     if (cmd) {
-      memcpy(cmd->text, text, sz);
+      cmd->text_offset = text_offset;
+      cmd->text_hash = text_hash;
       cmd->color = color;
       memcpy(cmd->fonts, fonts, sizeof(RenFont*)*FONT_FALLBACK_MAX);
       cmd->rect = rect;
@@ -211,8 +541,108 @@ double rencache_draw_text(RenWindow *window_renderer, RenFont **fonts, const cha
 }
 
 
+static int find_layer(const char *id) {
+  int free_slot = -1;
+  for (int i = 0; i < MAX_LAYERS; i++) {
+    if (layers[i].id && strcmp(layers[i].id, id) == 0) {
+      return i;
+    }
+    if (layers[i].last_used != layer_frame && (free_slot == -1 || layers[i].last_used < layers[free_slot].last_used)) {
+      free_slot = i;
+    }
+  }
+  if (free_slot == -1) { return -1; }
+  char *new_id = malloc(strlen(id) + 1);
+  if (!new_id) { return -1; }
+  strcpy(new_id, id);
+  Layer *layer = &layers[free_slot];
+  free(layer->id);
+  free(layer->pixels);
+  *layer = (Layer) { .id = new_id };
+  return free_slot;
+}
+
+
+bool rencache_begin_layer(RenWindow *window_renderer, const char *id, RenRect rect) {
+  if (layer_open) { return false; }
+  BeginLayerCommand *cmd = push_command(window_renderer, BEGIN_LAYER, sizeof(BeginLayerCommand));
+  if (cmd) {
+    cmd->rect = rect;
+    cmd->layer = find_layer(id);
+    if (cmd->layer != -1) {
+      layers[cmd->layer].last_used = layer_frame;
+    }
+  }
+  layer_open = true;
+  return true;
+}
+
+
+bool rencache_end_layer(RenWindow *window_renderer) {
+  if (!layer_open) { return false; }
+  push_command(window_renderer, END_LAYER, sizeof(RenRect));
+  layer_open = false;
+  return true;
+}
+
+
 void rencache_invalidate(void) {
-  memset(cells_prev, 0xff, sizeof(cells_buf1));
+  prev_commands_valid = false;
+  for (int i = 0; i < MAX_LAYERS; i++) {
+    layers[i].rect = (RenRect) { 0 };
+  }
+  if (cells_prev) {
+    memset(cells_prev, 0xff, sizeof(unsigned) * cells_x * cells_y);
+  }
+}
+
+
+void rencache_set_cell_count(int count) {
+  cell_count = rencache_max(count, 1);
+}
+
+
+static int grid_cell_size(int width, int height) {
+  int size = (int) ceil(sqrt((double) width * height / cell_count));
+  /* keep it a multiple of 8 so that the cells stay aligned on HiDPI surfaces */
+  size = (size + 7) & ~7;
+  return rencache_max(MIN_CELL_SIZE, rencache_min(size, MAX_CELL_SIZE));
+}
+
+
+static void resize_grid(int width, int height) {
+  int size = grid_cell_size(width, height);
+  /* a rect ending on the screen edge touches one more cell */
+  int nx = width / size + 1, ny = height / size + 1;
+  if (size == cell_size && nx <= cells_x && ny <= cells_y) {
+    return;
+  }
+  size_t n = (size_t) nx * ny;
+  unsigned *new_cells = malloc(n * sizeof(unsigned));
+  unsigned *new_cells_prev = malloc(n * sizeof(unsigned));
+  int *new_heads = malloc(n * sizeof(int));
+  /* one more rect for the scrolled region, which is only presented */
+  RenRect *new_rects = malloc((n + 1) * sizeof(RenRect));
+  int *new_open = malloc(nx * 2 * sizeof(int));
+  uint8_t *new_scroll_cells = malloc(n);
+  if (!new_cells || !new_cells_prev || !new_heads || !new_rects || !new_open || !new_scroll_cells) {
+    fprintf(stderr, "Warning: (" __FILE__ "): unable to resize the cell grid (%dx%d)\n", nx, ny);
+    free(new_cells); free(new_cells_prev); free(new_heads); free(new_rects); free(new_open); free(new_scroll_cells);
+    return;
+  }
+  free(cells); free(cells_prev); free(cell_heads); free(rect_buf); free(open_rects); free(scroll_cells);
+  cells = new_cells;
+  cells_prev = new_cells_prev;
+  cell_heads = new_heads;
+  rect_buf = new_rects;
+  open_rects = new_open;
+  scroll_cells = new_scroll_cells;
+  cell_size = size;
+  cells_x = nx;
+  cells_y = ny;
+  for (size_t i = 0; i < n; i++) {
+    cells[i] = HASH_INITIAL;
+  }
 }
 
 
@@ -220,125 +650,1005 @@ void rencache_begin_frame(RenWindow *window_renderer) {
   /* reset all cells if the screen width/height has changed */
   int w, h;
   resize_issue = false;
+  layer_open = false;
+  layer_frame++;
+  reset_text_pool();
   ren_get_size(window_renderer, &w, &h);
-  if (screen_rect.width != w || h != screen_rect.height) {
+  if (screen_rect.width != w || h != screen_rect.height || cell_size != grid_cell_size(w, h)) {
     screen_rect.width = w;
     screen_rect.height = h;
+    resize_grid(w, h);
     rencache_invalidate();
   }
   last_clip_rect = screen_rect;
 }
 
 
+static bool grow_array(void **array, int *capacity, int needed, size_t item_size) {
+  if (needed <= *capacity) { return true; }
+  int new_capacity = *capacity ? *capacity : 1024;
+  while (new_capacity < needed) { new_capacity *= 2; }
+  void *new_array = realloc(*array, new_capacity * item_size);
+  if (!new_array) { return false; }
+  *array = new_array;
+  *capacity = new_capacity;
+  return true;
+}
+
+
+/* the area a command can draw to */
+static RenRect command_bounds(enum CommandType type, RenRect r, RenRect clip) {
+  if (type == DRAW_TEXT) {
+    /* glyphs can overhang the advance based rect of the command (italics,
+    ** negative bearings), so give them some slack */
+    int margin = r.height / 2;
+    r = (RenRect) { r.x - margin, r.y - margin / 2, r.width + margin * 2, r.height + margin };
+  }
+  return intersect_rects(r, clip);
+}
+
+
+static void index_command(Command *cmd, RenRect clip, unsigned key) {
+  if (index_incomplete) { return; }
+  if (!grow_array((void**) &indexed_commands, &indexed_capacity, indexed_count + 1, sizeof(IndexedCommand))) {
+    fprintf(stderr, "Warning: (" __FILE__ "): unable to resize command index\n");
+    index_incomplete = true;
+    return;
+  }
+  RenRect r = command_bounds(cmd->type, cmd->command[0], clip);
+  if (r.width == 0 || r.height == 0) { return; }
+
+  int x1 = rencache_max(r.x, 0) / cell_size;
+  int y1 = rencache_max(r.y, 0) / cell_size;
+  int x2 = rencache_min((r.x + r.width) / cell_size, cells_x - 1);
+  int y2 = rencache_min((r.y + r.height) / cell_size, cells_y - 1);
+  int needed = cell_entry_count + (x2 - x1 + 1) * (y2 - y1 + 1);
+  if (!grow_array((void**) &cell_entries, &cell_entry_capacity, needed, sizeof(CellEntry))) {
+    fprintf(stderr, "Warning: (" __FILE__ "): unable to resize command index\n");
+    index_incomplete = true;
+    return;
+  }
+  int ordinal = indexed_count++;
+  indexed_commands[ordinal] = (IndexedCommand) { cmd, clip, cmd->command[0], key, cmd->type };
+  for (int y = y1; y <= y2; y++) {
+    for (int x = x1; x <= x2; x++) {
+      int idx = cell_idx(x, y);
+      cell_entries[cell_entry_count] = (CellEntry) { ordinal, cell_heads[idx] };
+      cell_heads[idx] = cell_entry_count++;
+    }
+  }
+}
+
+
 static void update_overlapping_cells(RenRect r, unsigned h) {
-  int x1 = r.x / CELL_SIZE;
-  int y1 = r.y / CELL_SIZE;
-  int x2 = (r.x + r.width) / CELL_SIZE;
-  int y2 = (r.y + r.height) / CELL_SIZE;
+  int x1 = r.x / cell_size;
+  int y1 = r.y / cell_size;
+  int x2 = rencache_min((r.x + r.width) / cell_size, cells_x - 1);
+  int y2 = rencache_min((r.y + r.height) / cell_size, cells_y - 1);
 
   for (int y = y1; y <= y2; y++) {
     for (int x = x1; x <= x2; x++) {
       int idx = cell_idx(x, y);
-      hash(&cells[idx], &h, sizeof(h));
+      hash_combine(&cells[idx], h);
     }
   }
 }
 
 
-static void push_rect(RenRect r, int *count) {
-  /* try to merge with existing rectangle */
-  for (int i = *count - 1; i >= 0; i--) {
-    RenRect *rp = &rect_buf[i];
-    if (rects_overlap(*rp, r)) {
-      *rp = merge_rects(*rp, r);
-      return;
+/* hashes the layer as a single command, its pixels are kept again if any of
+** its commands changed */
+static void finish_layer(RenSurface *rs, Command *begin, Command *end, RenRect clip, unsigned key) {
+  Layer *layer = &layers[((BeginLayerCommand*) begin->command)->layer];
+  RenRect rect = intersect_rects(begin->command[0], clip);
+  int bytes_per_pixel = rs->surface->format->BytesPerPixel;
+  layer->commands = (Command*) ((char*) begin + begin->size);
+  layer->commands_end = end;
+  RenRect pixel_rect = ren_scale_rect(rect, rs->scale);
+  if (pixel_rect.width <= 0 || pixel_rect.height <= 0) {
+    /* nothing of the layer is visible, its pixels are kept again once it is */
+    free(layer->pixels);
+    layer->pixels = NULL;
+    layer->rect = rect;
+    return;
+  }
+  if (layer->key != key || !same_rect(layer->rect, rect) || layer->scale != rs->scale
+      || layer->bytes_per_pixel != bytes_per_pixel) {
+    layer->pitch = pixel_rect.width * bytes_per_pixel;
+    uint8_t *pixels = realloc(layer->pixels, (size_t) layer->pitch * pixel_rect.height);
+    if (!pixels) {
+      /* drawn without keeping its pixels, they are allocated again next frame */
+      free(layer->pixels);
     }
+    layer->pixels = pixels;
+    layer->key = pixels ? key : ~key;
+    layer->rect = rect;
+    layer->scale = rs->scale;
+    layer->bytes_per_pixel = bytes_per_pixel;
+    layer->rebuild = true;
   }
-  /* couldn't merge with previous rectangle: push */
-  rect_buf[(*count)++] = r;
+  unsigned h = key;
+  hash_combine(&h, rect.x);
+  hash_combine(&h, rect.y);
+  hash_combine(&h, rect.width);
+  hash_combine(&h, rect.height);
+  update_overlapping_cells(rect, h);
+  index_command(begin, clip, key);
 }
 
 
-void rencache_end_frame(RenWindow *window_renderer) {
-  /* update cells from commands */
-  Command *cmd = NULL;
-  RenRect cr = screen_rect;
-  while (next_command(window_renderer, &cmd)) {
-    /* cmd->command[0] should always be the Command rect */
-    if (cmd->type == SET_CLIP) { cr = cmd->command[0]; }
-    RenRect r = intersect_rects(cmd->command[0], cr);
+static inline int rect_area(RenRect r) {
+  return r.width * r.height;
+}
+
+
+static inline bool rects_intersect(RenRect a, RenRect b) {
+  return a.x < b.x + b.width && b.x < a.x + a.width
+      && a.y < b.y + b.height && b.y < a.y + a.height;
+}
+
+
+static inline bool rect_contains(RenRect a, RenRect b) {
+  return b.x >= a.x && b.x + b.width <= a.x + a.width
+      && b.y >= a.y && b.y + b.height <= a.y + a.height;
+}
+
+
+static inline unsigned match_key(const IndexedCommand *c) {
+  unsigned key = c->key;
+  hash_combine(&key, c->clip.x);
+  hash_combine(&key, c->clip.y);
+  hash_combine(&key, c->clip.width);
+  hash_combine(&key, c->clip.height);
+  return key;
+}
+
+
+static bool build_match_table(void) {
+  int size = 1;
+  while (size < prev_count * 2) { size *= 2; }
+  if (!grow_array((void**) &match_heads, &match_heads_capacity, size, sizeof(int))
+   || !grow_array((void**) &match_next, &match_next_capacity, prev_count, sizeof(int))
+   || !grow_array((void**) &matched, &matched_capacity, (prev_count + 63) / 64, sizeof(uint64_t))) {
+    return false;
+  }
+  match_size = size;
+  memset(match_heads, 0xff, size * sizeof(int));
+  memset(matched, 0, (prev_count + 63) / 64 * sizeof(uint64_t));
+  for (int i = 0; i < prev_count; i++) {
+    int slot = match_key(&prev_commands[i]) & (size - 1);
+    match_next[i] = match_heads[slot];
+    match_heads[slot] = i;
+  }
+  return true;
+}
+
+
+/* finds a command of the previous frame with the same contents and clip as
+** the given one, drawn dy points above it */
+static int find_match(const IndexedCommand *c, unsigned key, int dy) {
+  for (int i = match_heads[key & (match_size - 1)]; i != -1; i = match_next[i]) {
+    const IndexedCommand *p = &prev_commands[i];
+    if (p->key == c->key && same_rect(p->clip, c->clip) && p->rect.y == c->rect.y - dy
+        && !(matched[i / 64] & ((uint64_t) 1 << (i % 64)))) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+
+/* looks for a clip region whose text moved vertically by the same amount
+** since the previous frame. Only text commands appearing once in the previous
+** frame vote, repeated tokens would just add noise. */
+static bool detect_scroll(RenRect *region, int *scroll_dy) {
+  if (!prev_commands_valid || prev_count == 0 || !build_match_table()) {
+    return false;
+  }
+  ScrollVote votes[SCROLL_MAX_VOTES];
+  int vote_count = 0;
+  for (int i = 0; i < indexed_count; i++) {
+    const IndexedCommand *c = &indexed_commands[i];
+    if (c->type != DRAW_TEXT) { continue; }
+    int found = -1, count = 0;
+    for (int j = match_heads[match_key(c) & (match_size - 1)]; j != -1; j = match_next[j]) {
+      if (prev_commands[j].key == c->key && same_rect(prev_commands[j].clip, c->clip)) {
+        found = j;
+        count++;
+      }
+    }
+    int dy = found != -1 ? c->rect.y - prev_commands[found].rect.y : 0;
+    if (count != 1 || dy == 0) { continue; }
+    int v = 0;
+    while (v < vote_count && (votes[v].dy != dy || !same_rect(votes[v].clip, c->clip))) { v++; }
+    if (v == vote_count) {
+      if (vote_count == SCROLL_MAX_VOTES) { continue; }
+      votes[vote_count++] = (ScrollVote) { c->clip, dy, 0 };
+    }
+    votes[v].count++;
+  }
+  int best = -1;
+  for (int v = 0; v < vote_count; v++) {
+    if (votes[v].count >= SCROLL_MIN_MATCHES && (best == -1 || votes[v].count > votes[best].count)) {
+      best = v;
+    }
+  }
+  if (best == -1) { return false; }
+
+  int text_count = 0;
+  for (int i = 0; i < indexed_count; i++) {
+    text_count += indexed_commands[i].type == DRAW_TEXT && same_rect(indexed_commands[i].clip, votes[best].clip);
+  }
+  RenRect r = intersect_rects(votes[best].clip, screen_rect);
+  int dy = votes[best].dy;
+  if (votes[best].count * 2 < text_count || abs(dy) >= r.height || r.height < cell_size * 2 || r.width < cell_size) {
+    return false;
+  }
+  *region = r;
+  *scroll_dy = dy;
+  return true;
+}
+
+
+static void damage_scrolled_rect(RenRect r, RenRect region) {
+  r = intersect_rects(r, region);
+  if (r.width == 0 || r.height == 0) { return; }
+  int x1 = r.x / cell_size, x2 = rencache_min((r.x + r.width - 1) / cell_size, cells_x - 1);
+  int y1 = r.y / cell_size, y2 = rencache_min((r.y + r.height - 1) / cell_size, cells_y - 1);
+  for (int y = y1; y <= y2; y++) {
+    for (int x = x1; x <= x2; x++) {
+      scroll_cells[cell_idx(x, y)] = CELL_DAMAGED;
+    }
+  }
+}
+
+
+/* damages the rows that a translation by dy moves in or out of the rect */
+static void damage_translated_edges(RenRect r, int dy, RenRect region) {
+  int y = rencache_min(0, dy), h = abs(dy);
+  damage_scrolled_rect((RenRect) { r.x, r.y + y, r.width, h }, region);
+  damage_scrolled_rect((RenRect) { r.x, r.y + r.height + y, r.width, h }, region);
+}
+
+
+/* once the pixels of the region have been moved by dy, works out which cells
+** of it still have to be drawn: the exposed rows, the commands that changed
+** beyond the translation and the edges of the clip rects and of the static
+** rects, which don't move along with the contents */
+static void damage_scrolled_region(RenRect region, int dy) {
+  memset(scroll_cells, CELL_TRACKED, cells_x * cells_y);
+  int x1 = (region.x + cell_size - 1) / cell_size, x2 = (region.x + region.width) / cell_size;
+  int y1 = (region.y + cell_size - 1) / cell_size, y2 = (region.y + region.height) / cell_size;
+  for (int y = y1; y < y2; y++) {
+    for (int x = x1; x < x2; x++) {
+      scroll_cells[cell_idx(x, y)] = CELL_SCROLLED;
+    }
+  }
+  damage_translated_edges(region, dy, region);
+
+  RenRect last_clip = { 0, 0, -1, -1 };
+  for (int i = 0; i < indexed_count; i++) {
+    const IndexedCommand *c = &indexed_commands[i];
+    RenRect bounds = command_bounds(c->type, c->rect, c->clip);
+    if (!rects_overlap(bounds, region)) { continue; }
+    unsigned key = match_key(c);
+    int j = find_match(c, key, dy);
+    if (c->type == BEGIN_LAYER && layers[((BeginLayerCommand*) c->cmd->command)->layer].rebuild) {
+      /* its pixels have to be kept again, moving the old ones isn't enough */
+      damage_scrolled_rect(bounds, region);
+      continue;
+    } else if (j != -1) {
+      /* moved along: only the edges of its clip rect are wrong */
+      if (!same_rect(c->clip, last_clip)) {
+        damage_translated_edges(c->clip, dy, region);
+        last_clip = c->clip;
+      }
+    } else if ((j = find_match(c, key, 0)) != -1) {
+      if (c->type == DRAW_RECT) {
+        damage_translated_edges(intersect_rects(c->rect, c->clip), dy, region);
+      } else {
+        damage_scrolled_rect(bounds, region);
+        bounds.y += dy;
+        damage_scrolled_rect(bounds, region);
+      }
+    } else {
+      damage_scrolled_rect(bounds, region);
+      continue;
+    }
+    matched[j / 64] |= (uint64_t) 1 << (j % 64);
+  }
+
+  /* the commands that went away were moved along with the pixels */
+  for (int i = 0; i < prev_count; i++) {
+    if (!(matched[i / 64] & ((uint64_t) 1 << (i % 64)))) {
+      const IndexedCommand *p = &prev_commands[i];
+      RenRect bounds = command_bounds(p->type, p->rect, p->clip);
+      bounds.y += dy;
+      damage_scrolled_rect(bounds, region);
+    }
+  }
+}
+
+
+/* remembers the rects drawn without some of their glyphs */
+static void add_retry_rects(const RenRect *rects, int count) {
+  if (count == 0) { return; }
+  if (retry_count + count <= MAX_RETRY_RECTS) {
+    memcpy(retry_rects + retry_count, rects, count * sizeof(RenRect));
+    retry_count += count;
+    return;
+  }
+  RenRect bounds = rects[0];
+  for (int i = 1; i < count; i++) { bounds = merge_rects(bounds, rects[i]); }
+  for (int i = 0; i < retry_count; i++) { bounds = merge_rects(bounds, retry_rects[i]); }
+  retry_rects[0] = bounds;
+  retry_count = 1;
+}
+
+
+/* the parts of the retry rects in the scrolled region moved along with it */
+static void scroll_retry_rects(RenRect region, int dy) {
+  for (int i = 0; i < retry_count; i++) {
+    RenRect moved = intersect_rects(retry_rects[i], region);
+    if (moved.width == 0 || moved.height == 0) { continue; }
+    moved.y += dy;
+    moved = intersect_rects(moved, region);
+    if (moved.width > 0 && moved.height > 0) {
+      retry_rects[i] = merge_rects(retry_rects[i], moved);
+    }
+  }
+}
+
+
+/* once the missing glyphs are in, damages the cells of the retry rects so
+** that they are drawn again, along with the layers kept over them */
+static void damage_retry_rects(bool scrolling) {
+  for (int i = 0; i < retry_count; i++) {
+    RenRect r = intersect_rects(retry_rects[i], screen_rect);
     if (r.width == 0 || r.height == 0) { continue; }
-    unsigned h = HASH_INITIAL;
-    hash(&h, cmd, cmd->size);
-    update_overlapping_cells(r, h);
+    int x2 = rencache_min((r.x + r.width - 1) / cell_size, cells_x - 1);
+    int y2 = rencache_min((r.y + r.height - 1) / cell_size, cells_y - 1);
+    for (int y = r.y / cell_size; y <= y2; y++) {
+      for (int x = r.x / cell_size; x <= x2; x++) {
+        int idx = cell_idx(x, y);
+        cells_prev[idx] = ~cells[idx];
+        if (scrolling) { scroll_cells[idx] = CELL_DAMAGED; }
+      }
+    }
+    for (int j = 0; j < MAX_LAYERS; j++) {
+      if (layers[j].pixels && rects_intersect(layers[j].rect, r)) {
+        layers[j].rebuild = true;
+      }
+    }
   }
+  retry_count = 0;
+}
 
-  /* push rects for all cells changed from last frame, reset cells */
-  int rect_count = 0;
-  int max_x = screen_rect.width / CELL_SIZE + 1;
-  int max_y = screen_rect.height / CELL_SIZE + 1;
+
+static inline bool cell_changed(int idx, bool scrolling) {
+  if (scrolling && scroll_cells[idx] != CELL_TRACKED) {
+    return scroll_cells[idx] == CELL_DAMAGED;
+  }
+  return cells[idx] != cells_prev[idx];
+}
+
+
+/* turns the changed cells into rects: first the cells of each row are
+** coalesced into horizontal runs, then each run extends the rect of the
+** previous row spanning the same columns, if any. Resets the cells. */
+static int collect_changed_cells(int max_x, int max_y, bool scrolling) {
+  int count = 0;
+  int *prev = open_rects, *cur = open_rects + cells_x;
+  int prev_count = 0;
   for (int y = 0; y < max_y; y++) {
+    int cur_count = 0, p = 0;
     for (int x = 0; x < max_x; x++) {
       /* compare previous and current cell for change */
       int idx = cell_idx(x, y);
-      if (cells[idx] != cells_prev[idx]) {
-        push_rect((RenRect) { x, y, 1, 1 }, &rect_count);
-      }
+      bool changed = cell_changed(idx, scrolling);
       cells_prev[idx] = HASH_INITIAL;
+      if (!changed) { continue; }
+      int run_start = x;
+      while (x + 1 < max_x && cell_changed(cell_idx(x + 1, y), scrolling)) {
+        cells_prev[cell_idx(++x, y)] = HASH_INITIAL;
+      }
+      int run_width = x - run_start + 1;
+      while (p < prev_count && rect_buf[prev[p]].x < run_start) { p++; }
+      if (p < prev_count && rect_buf[prev[p]].x == run_start && rect_buf[prev[p]].width == run_width) {
+        rect_buf[prev[p]].height++;
+        cur[cur_count++] = prev[p++];
+      } else {
+        rect_buf[count] = (RenRect) { run_start, y, run_width, 1 };
+        cur[cur_count++] = count++;
+      }
     }
+    int *tmp = prev;
+    prev = cur;
+    cur = tmp;
+    prev_count = cur_count;
+  }
+  return count;
+}
+
+
+static int compare_rows(const void *a, const void *b) {
+  const RenRect *ra = a, *rb = b;
+  return ra->y != rb->y ? ra->y - rb->y : ra->x - rb->x;
+}
+
+
+static int compare_columns(const void *a, const void *b) {
+  const RenRect *ra = a, *rb = b;
+  return ra->x != rb->x ? ra->x - rb->x : ra->y - rb->y;
+}
+
+
+/* merges the rect at i into the one at last if their union doesn't cost much
+** more than drawing them separately and doesn't partially cover any other
+** rect. The rects it covers are emptied, to be dropped after the sweep. */
+static bool merge_into(int count, int last, int i) {
+  RenRect u = merge_rects(rect_buf[last], rect_buf[i]);
+  if (rect_area(u) > MERGE_MAX_COST * (rect_area(rect_buf[last]) + rect_area(rect_buf[i]))) {
+    return false;
   }
+  for (int k = 0; k < count; k++) {
+    if (rect_buf[k].width > 0 && rects_intersect(u, rect_buf[k]) && !rect_contains(u, rect_buf[k])) {
+      return false;
+    }
+  }
+  for (int k = 0; k < count; k++) {
+    if (k != last && rect_buf[k].width > 0 && rect_contains(u, rect_buf[k])) {
+      rect_buf[k].width = 0;
+    }
+  }
+  rect_buf[last] = u;
+  return true;
+}
+
+
+/* sorts the rects and merges each one into the last rect kept before it, in
+** a single pass; with rows, only rects spanning the same rows are merged */
+static int merge_sweep(int count, bool rows) {
+  qsort(rect_buf, count, sizeof(RenRect), rows ? compare_rows : compare_columns);
+  int last = -1;
+  for (int i = 0; i < count; i++) {
+    if (rect_buf[i].width == 0) { continue; }
+    bool same_rows = last != -1 && rect_buf[last].y == rect_buf[i].y && rect_buf[last].height == rect_buf[i].height;
+    if (last != -1 && (!rows || same_rows) && merge_into(count, last, i)) { continue; }
+    last = i;
+  }
+  int kept = 0;
+  for (int i = 0; i < count; i++) {
+    if (rect_buf[i].width > 0) { rect_buf[kept++] = rect_buf[i]; }
+  }
+  return kept;
+}
+
+
+/* coalesces the rects of the same rows first, then the ones stacked in the
+** same columns; each sweep is at worst quadratic in the number of rects */
+static int merge_rect_pass(int count) {
+  if (count > MERGE_MAX_RECTS) { return count; }
+  count = merge_sweep(count, true);
+  return merge_sweep(count, false);
+}
+
+
+static void set_surface_clip_rect(RenSurface *rs, RenRect rect) {
+  rect = ren_scale_rect(rect, rs->scale);
+  SDL_SetClipRect(rs->surface, &(SDL_Rect){ rect.x, rect.y, rect.width, rect.height });
+}
+
+
+static void draw_command(RenSurface *rs, Command *cmd) {
+  if (cmd->type == DRAW_RECT) {
+    DrawRectCommand *rcmd = (DrawRectCommand*)&cmd->command;
+    ren_draw_rect(rs, rcmd->rect, rcmd->color);
+  } else if (cmd->type == DRAW_TEXT) {
+    DrawTextCommand *tcmd = (DrawTextCommand*)&cmd->command;
+    ren_draw_text(rs, tcmd->fonts, text_pool.data + tcmd->text_offset, tcmd->len, tcmd->text_x, tcmd->rect.y, tcmd->color, tcmd->tab_size);
+  }
+}
+
+
+/* copies the pixels of the area between the surface and the layer */
+static void copy_layer_pixels(RenSurface *rs, Layer *layer, RenRect area, bool keep) {
+  SDL_Surface *surface = rs->surface;
+  const int bpp = layer->bytes_per_pixel;
+  RenRect pixel_area = ren_scale_rect(area, layer->scale);
+  RenRect layer_rect = ren_scale_rect(layer->rect, layer->scale);
+  int x = pixel_area.x, y = pixel_area.y;
+  int w = rencache_min(pixel_area.width, surface->w - x);
+  int h = rencache_min(pixel_area.height, surface->h - y);
+  if (w <= 0 || h <= 0) { return; }
+  uint8_t *pixels = (uint8_t *) surface->pixels + y * surface->pitch + x * bpp;
+  uint8_t *kept = layer->pixels + (y - layer_rect.y) * layer->pitch + (x - layer_rect.x) * bpp;
+  for (int row = 0; row < h; row++) {
+    if (keep) {
+      memcpy(kept + row * layer->pitch, pixels + row * surface->pitch, w * bpp);
+    } else {
+      memcpy(pixels + row * surface->pitch, kept + row * layer->pitch, w * bpp);
+    }
+  }
+}
+
+
+static void draw_layer(RenSurface *rs, IndexedCommand *icmd, RenRect r) {
+  Layer *layer = &layers[((BeginLayerCommand*) icmd->cmd->command)->layer];
+  RenRect area = intersect_rects(layer->rect, r);
+  if (area.width == 0 || area.height == 0) { return; }
+  if (!layer->rebuild) {
+    copy_layer_pixels(rs, layer, area, false);
+    return;
+  }
+  RenRect clip = icmd->clip;
+  for (Command *cmd = layer->commands; cmd != layer->commands_end; cmd = (Command*) ((char*) cmd + cmd->size)) {
+    if (cmd->type == SET_CLIP) {
+      clip = cmd->command[0];
+    } else {
+      set_surface_clip_rect(rs, intersect_rects(clip, area));
+      draw_command(rs, cmd);
+    }
+  }
+  if (layer->pixels) {
+    copy_layer_pixels(rs, layer, area, true);
+  }
+}
+
+
+/* draws every command of the frame clipped to the rect, layers included as
+** plain commands */
+static void draw_rect_all_commands(RenSurface *rs, RenRect r) {
+  RenRect clip = screen_rect;
+  for (Command *cmd = frame_commands; cmd != frame_commands_end; cmd = (Command*) ((char*) cmd + cmd->size)) {
+    if (cmd->type == SET_CLIP) {
+      clip = cmd->command[0];
+    } else if (cmd->type == DRAW_RECT || cmd->type == DRAW_TEXT) {
+      set_surface_clip_rect(rs, intersect_rects(clip, r));
+      draw_command(rs, cmd);
+    }
+  }
+}
+
+
+static bool reserve_marks(RenderWorker *worker) {
+  size_t words = (indexed_count + 63) / 64;
+  if (words > worker->marks_capacity) {
+    uint64_t *marks = realloc(worker->marks, words * sizeof(uint64_t));
+    if (!marks) { return false; }
+    worker->marks = marks;
+    worker->marks_capacity = words;
+  }
+  return true;
+}
+
+
+static void draw_rect_commands(RenderWorker *worker, RenRect r) {
+  /* the marks of the workers are reserved before drawing in parallel, only
+  ** the main thread gets here without them */
+  if (!index_incomplete && !reserve_marks(worker)) {
+    fprintf(stderr, "Warning: (" __FILE__ "): unable to resize command marks\n");
+    index_incomplete = true;
+  }
+  if (index_incomplete) {
+    draw_rect_all_commands(&worker->rs, r);
+    return;
+  }
+
+  /* collect the commands of all cells covered by the rect */
+  size_t words = (indexed_count + 63) / 64;
+  memset(worker->marks, 0, words * sizeof(uint64_t));
+  int x1 = r.x / cell_size, x2 = rencache_min((r.x + r.width - 1) / cell_size, cells_x - 1);
+  int y1 = r.y / cell_size, y2 = rencache_min((r.y + r.height - 1) / cell_size, cells_y - 1);
+  for (int y = y1; y <= y2; y++) {
+    for (int x = x1; x <= x2; x++) {
+      for (int e = cell_heads[cell_idx(x, y)]; e != -1; e = cell_entries[e].next) {
+        int ordinal = cell_entries[e].command;
+        worker->marks[ordinal / 64] |= (uint64_t) 1 << (ordinal % 64);
+      }
+    }
+  }
+
+  /* replay them in submission order */
+  RenSurface *rs = &worker->rs;
+  RenRect clip = { 0, 0, -1, -1 };
+  for (size_t w = 0; w < words; w++) {
+    for (uint64_t bits = worker->marks[w]; bits; bits &= bits - 1) {
+      IndexedCommand *icmd = &indexed_commands[w * 64 + lowest_bit(bits)];
+      Command *cmd = icmd->cmd;
+      RenRect cr = intersect_rects(icmd->clip, r);
+      if (memcmp(&cr, &clip, sizeof(RenRect)) != 0) {
+        set_surface_clip_rect(rs, cr);
+        clip = cr;
+      }
+      if (cmd->type == BEGIN_LAYER) {
+        draw_layer(rs, icmd, r);
+        clip = (RenRect) { 0, 0, -1, -1 };
+      } else {
+        draw_command(rs, cmd);
+      }
+    }
+  }
+}
+
+
+static void draw_band(RenderWorker *worker) {
+  for (int i = 0; i < pool.rect_count; i++) {
+    RenRect r = intersect_rects(rect_buf[i], worker->band);
+    if (r.width > 0 && r.height > 0) {
+      draw_rect_commands(worker, r);
+    }
+  }
+}
+
+
+static int render_worker_main(void *data) {
+  RenderWorker *worker = data;
+  while (true) {
+    SDL_SemWait(worker->start);
+    if (pool.quit) { break; }
+    draw_band(worker);
+    SDL_SemPost(pool.done);
+  }
+  return 0;
+}
+
+
+static void init_render_pool(void) {
+  pool.initialized = true;
+  /* the main thread draws a band as well */
+  int n = rencache_min(SDL_GetCPUCount(), MAX_RENDER_THREADS + 1) - 1;
+  if (n <= 0 || !(pool.done = SDL_CreateSemaphore(0))) {
+    return;
+  }
+  for (int i = 0; i < n; i++) {
+    RenderWorker *worker = &pool.workers[i];
+    if (!(worker->start = SDL_CreateSemaphore(0))) { break; }
+    worker->thread = SDL_CreateThread(render_worker_main, "rencache", worker);
+    if (!worker->thread) {
+      SDL_DestroySemaphore(worker->start);
+      break;
+    }
+    pool.count++;
+  }
+  if (pool.count == 0) {
+    fprintf(stderr, "Warning: (" __FILE__ "): unable to start render threads, drawing on the main thread\n");
+  }
+}
+
+
+void rencache_get_frame_stats(RenFrameStats *stats) {
+  *stats = frame_stats;
+  stats->rects = frame_rects;
+}
+
+
+void rencache_shutdown(void) {
+  pool.quit = true;
+  for (int i = 0; i < pool.count; i++) {
+    SDL_SemPost(pool.workers[i].start);
+    SDL_WaitThread(pool.workers[i].thread, NULL);
+    SDL_DestroySemaphore(pool.workers[i].start);
+  }
+  if (pool.done) {
+    SDL_DestroySemaphore(pool.done);
+  }
+  pool.count = 0;
+  pool.done = NULL;
+  for (int i = 0; i < MAX_RENDER_THREADS; i++) {
+    free(pool.workers[i].marks);
+    if (pool.workers[i].rs.surface) {
+      SDL_FreeSurface(pool.workers[i].rs.surface);
+      pool.workers[i].rs.surface = NULL;
+    }
+  }
+  free(main_worker.marks);
+  free(indexed_commands);
+  free(prev_commands);
+  free(match_heads);
+  free(match_next);
+  free(matched);
+  free(scroll_cells);
+  free(prev_command_buf);
+  free(command_keys);
+  free(prev_command_keys);
+  free(text_pool.data);
+  free(text_pool.entries);
+  free(frame_rects);
+  for (int i = 0; i < MAX_LAYERS; i++) {
+    free(layers[i].id);
+    free(layers[i].pixels);
+    layers[i] = (Layer) { 0 };
+  }
+  free(cell_entries);
+  free(cells);
+  free(cells_prev);
+  free(cell_heads);
+  free(rect_buf);
+  free(open_rects);
+  cells = cells_prev = NULL;
+  cell_heads = NULL;
+  rect_buf = NULL;
+  open_rects = NULL;
+  scroll_cells = NULL;
+  prev_command_buf = NULL;
+  prev_command_buf_idx = prev_command_buf_size = 0;
+  memset(&text_pool, 0, sizeof(text_pool));
+  frame_rects = NULL;
+  frame_rects_capacity = 0;
+  retry_count = 0;
+  frame_stats = (RenFrameStats) { 0 };
+}
+
+
+/* points the surface of a worker at the window pixels. The surface is kept
+** between frames and only created again when the window surface changes size
+** or format; the pixels can move on every frame, as the texture is locked. */
+static bool alias_surface(RenSurface *dst, const RenSurface *src) {
+  SDL_Surface *s = src->surface, *d = dst->surface;
+  dst->scale = src->scale;
+  if (!d || d->w != s->w || d->h != s->h || d->pitch != s->pitch || d->format->format != s->format->format) {
+    if (d) { SDL_FreeSurface(d); }
+    dst->surface = d = SDL_CreateRGBSurfaceWithFormatFrom(s->pixels, s->w, s->h, s->format->BitsPerPixel, s->pitch, s->format->format);
+    if (!d) {
+      fprintf(stderr, "Warning: (" __FILE__ "): unable to create a render thread surface: %s\n", SDL_GetError());
+      return false;
+    }
+  }
+  d->pixels = s->pixels;
+  return true;
+}
+
+
+/* draws the dirty rects using the render threads, returns false if the
+** frame should be drawn serially instead */
+static bool draw_rects_parallel(RenSurface *rs, int rect_count) {
+  if (!pool.initialized) {
+    init_render_pool();
+  }
+  if (pool.count == 0) { return false; }
+
+  int area = 0, y1 = screen_rect.height, y2 = 0;
+  for (int i = 0; i < rect_count; i++) {
+    area += rect_buf[i].width * rect_buf[i].height;
+    y1 = rencache_min(y1, rect_buf[i].y);
+    y2 = rencache_max(y2, rect_buf[i].y + rect_buf[i].height);
+  }
+  int bands = rencache_min(pool.count + 1, y2 - y1);
+  if (area < PARALLEL_MIN_AREA || bands < 2 || index_incomplete) { return false; }
+  if (!reserve_marks(&main_worker)) { return false; }
+  for (int i = 0; i < bands - 1; i++) {
+    if (!reserve_marks(&pool.workers[i])) { return false; }
+  }
+
+  main_worker.rs = *rs;
+  RenderWorker *workers[MAX_RENDER_THREADS + 1];
+  for (int i = 0; i < bands - 1; i++) {
+    if (!alias_surface(&pool.workers[i].rs, rs)) { return false; }
+    workers[i] = &pool.workers[i];
+  }
+  workers[bands - 1] = &main_worker;
+
+  for (int i = 0; i < bands; i++) {
+    int top = y1 + (y2 - y1) * i / bands, bottom = y1 + (y2 - y1) * (i + 1) / bands;
+    workers[i]->band = (RenRect) { 0, top, screen_rect.width, bottom - top };
+  }
+  pool.rect_count = rect_count;
+  for (int i = 0; i < bands - 1; i++) {
+    SDL_SemPost(workers[i]->start);
+  }
+  draw_band(&main_worker);
+  /* join: every band must be done before the rects are presented */
+  for (int i = 0; i < bands - 1; i++) {
+    SDL_SemWait(pool.done);
+  }
+  return true;
+}
+
+
+bool rencache_end_frame(RenWindow *window_renderer) {
+  if (!cells) {
+    /* the cell grid couldn't be allocated, nothing can be tracked */
+    window_renderer->command_buf_idx = 0;
+    return false;
+  }
+
+  /* the glyphs some text was drawn without have all been rasterized */
+  bool retry = retry_count > 0 && ren_get_pending_glyphs() == 0;
+
+  /* nothing to do if the frame is the same as the previous one, the cells
+  ** are already reset and the screen is up to date */
+  bool identical;
+  int unchanged = unchanged_command_count(window_renderer, &identical);
+  if (identical && !retry) {
+    frame_stats = (RenFrameStats) {
+      .command_count = prev_command_keys_count,
+      .command_bytes = window_renderer->command_buf_idx,
+      .text_bytes = text_pool.idx,
+      .pending_glyphs = ren_get_pending_glyphs()
+    };
+    window_renderer->command_buf_idx = 0;
+    return retry_count > 0;
+  }
+
+  /* update cells from commands and build the spatial index */
+  RenSurface rs = renwin_get_surface(window_renderer);
+  Command *cmd = NULL, *layer_cmd = NULL;
+  RenRect cr = screen_rect, layer_clip = screen_rect;
+  unsigned layer_key = 0;
+  int ordinal = 0;
+  bool keep_keys = true;
+  indexed_count = 0;
+  cell_entry_count = 0;
+  index_incomplete = false;
+  memset(cell_heads, 0xff, sizeof(int) * cells_x * cells_y);
+  while (next_command(window_renderer, &cmd)) {
+    int n = ordinal++;
+    keep_keys = keep_keys && grow_array((void**) &command_keys, &command_keys_capacity, ordinal, sizeof(unsigned));
+    if (cmd->type == END_LAYER) {
+      if (layer_cmd) { finish_layer(&rs, layer_cmd, cmd, layer_clip, layer_key); }
+      layer_cmd = NULL;
+      continue;
+    }
+    /* cmd->command[0] should always be the Command rect */
+    if (cmd->type == SET_CLIP) { cr = cmd->command[0]; }
+    RenRect r = intersect_rects(cmd->command[0], cr);
+    if (r.width == 0 || r.height == 0) { continue; }
+    unsigned key = n < unchanged ? prev_command_keys[n] : command_key(cmd), h = key;
+    if (keep_keys) { command_keys[n] = key; }
+    if (layer_cmd) {
+      /* the commands of a layer only count through the key of the layer */
+      hash_combine(&layer_key, key);
+      hash_combine(&layer_key, cmd->command[0].y - layer_cmd->command[0].y);
+      continue;
+    }
+    if (cmd->type == BEGIN_LAYER) {
+      if (((BeginLayerCommand*) cmd->command)->layer != -1) {
+        layer_cmd = cmd;
+        layer_clip = cr;
+        layer_key = key;
+      }
+      continue;
+    }
+    hash_combine(&h, cmd->command[0].y);
+    update_overlapping_cells(r, h);
+    if (cmd->type != SET_CLIP) {
+      index_command(cmd, cr, key);
+    }
+  }
+  if (layer_cmd) {
+    finish_layer(&rs, layer_cmd, cmd, layer_clip, layer_key);
+  }
+  frame_commands = (Command*) window_renderer->command_buf;
+  frame_commands_end = cmd;
+
+  /* if a region just scrolled, move its pixels instead of redrawing it */
+  RenRect scroll_region;
+  int scroll_dy;
+  bool scrolling = detect_scroll(&scroll_region, &scroll_dy);
+  /* at a fractional scale text only lands on the same pixels after a move
+  ** by a whole number of them */
+  if (scrolling && scroll_dy * rs.scale != floorf(scroll_dy * rs.scale)) {
+    scrolling = false;
+  }
+  if (scrolling) {
+    damage_scrolled_region(scroll_region, scroll_dy);
+    scroll_retry_rects(scroll_region, scroll_dy);
+  }
+  if (retry) {
+    damage_retry_rects(scrolling);
+  }
+
+  /* push rects for all cells changed from last frame, reset cells */
+  int max_x = rencache_min(screen_rect.width / cell_size + 1, cells_x);
+  int max_y = rencache_min(screen_rect.height / cell_size + 1, cells_y);
+  int rect_count = collect_changed_cells(max_x, max_y, scrolling);
+  rect_count = merge_rect_pass(rect_count);
 
   /* expand rects from cells to pixels */
   for (int i = 0; i < rect_count; i++) {
     RenRect *r = &rect_buf[i];
-    r->x *= CELL_SIZE;
-    r->y *= CELL_SIZE;
-    r->width *= CELL_SIZE;
-    r->height *= CELL_SIZE;
+    r->x *= cell_size;
+    r->y *= cell_size;
+    r->width *= cell_size;
+    r->height *= cell_size;
     *r = intersect_rects(*r, screen_rect);
   }
 
-  RenSurface rs = renwin_get_surface(window_renderer);
+  /* only the pixels of the bounds of this frame's changes are drawn to */
+  if (rect_count > 0 || scrolling) {
+    RenRect bounds = scrolling ? scroll_region : rect_buf[0];
+    for (int i = 0; i < rect_count; i++) {
+      bounds = merge_rects(bounds, rect_buf[i]);
+    }
+    renwin_lock_surface(window_renderer, bounds);
+  }
+  if (scrolling) {
+    ren_scroll_rect(&rs, scroll_region, scroll_dy);
+  }
+
   /* redraw updated regions */
-  for (int i = 0; i < rect_count; i++) {
-    /* draw */
-    RenRect r = rect_buf[i];
-    ren_set_clip_rect(window_renderer, r);
-
-    cmd = NULL;
-    while (next_command(window_renderer, &cmd)) {
-      SetClipCommand *ccmd = (SetClipCommand*)&cmd->command;
-      DrawRectCommand *rcmd = (DrawRectCommand*)&cmd->command;
-      DrawTextCommand *tcmd = (DrawTextCommand*)&cmd->command;
-      switch (cmd->type) {
-        case SET_CLIP:
-          ren_set_clip_rect(window_renderer, intersect_rects(ccmd->rect, r));
-          break;
-        case DRAW_RECT:
-          ren_draw_rect(&rs, rcmd->rect, rcmd->color);
-          break;
-        case DRAW_TEXT:
-          ren_font_group_set_tab_size(tcmd->fonts, tcmd->tab_size);
-          ren_draw_text(&rs, tcmd->fonts, tcmd->text, tcmd->len, tcmd->text_x, tcmd->rect.y, tcmd->color);
-          break;
-      }
+  if (!draw_rects_parallel(&rs, rect_count)) {
+    main_worker.rs = rs;
+    for (int i = 0; i < rect_count; i++) {
+      draw_rect_commands(&main_worker, rect_buf[i]);
+    }
+  }
+  if (ren_take_deferred_glyphs() > 0) {
+    add_retry_rects(rect_buf, rect_count);
+  }
+
+  /* the layers drawn again have their pixels now, unless their commands were
+  ** replayed without them */
+  for (int i = 0; i < MAX_LAYERS && !index_incomplete; i++) {
+    if (layers[i].rebuild && layers[i].last_used == layer_frame && layers[i].pixels) {
+      layers[i].rebuild = false;
     }
+  }
 
-    if (show_debug) {
+  if (show_debug) {
+    for (int i = 0; i < rect_count; i++) {
       RenColor color = { rand(), rand(), rand(), 50 };
-      ren_draw_rect(&rs, r, color);
+      set_surface_clip_rect(&rs, rect_buf[i]);
+      ren_draw_rect(&rs, rect_buf[i], color);
     }
   }
 
-  /* update dirty rects */
+  frame_stats = (RenFrameStats) {
+    .scroll_dy = scrolling ? scroll_dy : 0,
+    .command_count = ordinal,
+    .command_bytes = window_renderer->command_buf_idx,
+    .text_bytes = text_pool.idx,
+    .pending_glyphs = ren_get_pending_glyphs()
+  };
+  for (int i = 0; i < rect_count; i++) {
+    RenRect r = ren_scale_rect(rect_buf[i], rs.scale);
+    frame_stats.redrawn_area += (int64_t) r.width * r.height;
+  }
+
+  /* update dirty rects, the scrolled region has to be presented whole */
+  if (scrolling) {
+    rect_buf[rect_count++] = scroll_region;
+  }
   if (rect_count > 0) {
     ren_update_rects(window_renderer, rect_buf, rect_count);
   }
+  if (grow_array((void**) &frame_rects, &frame_rects_capacity, rect_count, sizeof(RenRect))) {
+    memcpy(frame_rects, rect_buf, rect_count * sizeof(RenRect));
+    frame_stats.rect_count = rect_count;
+  }
 
   /* swap cell buffer and reset */
   unsigned *tmp = cells;
   cells = cells_prev;
   cells_prev = tmp;
+
+  /* keep the commands of this frame to detect scrolling in the next one */
+  IndexedCommand *tmp_commands = indexed_commands;
+  int tmp_capacity = indexed_capacity;
+  indexed_commands = prev_commands;
+  indexed_capacity = prev_capacity;
+  prev_commands = tmp_commands;
+  prev_capacity = tmp_capacity;
+  prev_count = indexed_count;
+  prev_commands_valid = !resize_issue && !index_incomplete;
+
+  /* keep the command buffer and the keys of this frame to compare with the
+  ** next one */
+  unsigned *tmp_keys = command_keys;
+  int tmp_keys_capacity = command_keys_capacity;
+  command_keys = prev_command_keys;
+  command_keys_capacity = prev_command_keys_capacity;
+  prev_command_keys = tmp_keys;
+  prev_command_keys_capacity = tmp_keys_capacity;
+  prev_command_keys_count = keep_keys ? ordinal : 0;
+
+  uint8_t *tmp_buf = window_renderer->command_buf;
+  size_t tmp_buf_size = window_renderer->command_buf_size;
+  window_renderer->command_buf = prev_command_buf;
+  window_renderer->command_buf_size = prev_command_buf_size;
+  prev_command_buf = tmp_buf;
+  prev_command_buf_size = tmp_buf_size;
+  prev_command_buf_idx = window_renderer->command_buf_idx;
   window_renderer->command_buf_idx = 0;
+  return retry_count > 0;
 }
-
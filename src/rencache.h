@@ -5,12 +5,29 @@
 #include <lua.h>
 #include "renderer.h"
 
+/* what the last rencache_end_frame did, rects are in points */
+typedef struct {
+  const RenRect *rects;     /* presented rects, including the scrolled region */
+  int rect_count;
+  int64_t redrawn_area;     /* area that was drawn again, in pixels */
+  int scroll_dy;            /* offset the scrolled region moved by, 0 if none */
+  int command_count;
+  size_t command_bytes;     /* used in the command buffer */
+  size_t text_bytes;        /* used in the text pool */
+  int pending_glyphs;       /* glyphs still being rasterized */
+} RenFrameStats;
+
 void  rencache_show_debug(bool enable);
 void  rencache_set_clip_rect(RenWindow *window_renderer, RenRect rect);
 void  rencache_draw_rect(RenWindow *window_renderer, RenRect rect, RenColor color);
 double rencache_draw_text(RenWindow *window_renderer, RenFont **font, const char *text, size_t len, double x, int y, RenColor color);
+bool  rencache_begin_layer(RenWindow *window_renderer, const char *id, RenRect rect);
+bool  rencache_end_layer(RenWindow *window_renderer);
 void  rencache_invalidate(void);
+void  rencache_set_cell_count(int count);
 void  rencache_begin_frame(RenWindow *window_renderer);
-void  rencache_end_frame(RenWindow *window_renderer);
+bool  rencache_end_frame(RenWindow *window_renderer);
+void  rencache_get_frame_stats(RenFrameStats *stats);
+void  rencache_shutdown(void);
 
 #endif
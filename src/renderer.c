@@ -3,30 +3,82 @@
 #include <stdint.h>
 #include <assert.h>
 #include <math.h>
+#include <sys/stat.h>
 #include <ft2build.h>
 #include FT_FREETYPE_H
+#include FT_ADVANCES_H
+#include FT_GLYPH_H
 #include FT_LCD_FILTER_H
 #include FT_OUTLINE_H
+#include FT_SIZES_H
 #include FT_SYSTEM_H
 
 #ifdef _WIN32
 #include <windows.h>
 #include "utfconv.h"
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #endif
 
 #include "renderer.h"
 #include "renwindow.h"
 
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+  #define RENDERER_X86_SIMD
+  #include <immintrin.h>
+  #if defined(__GNUC__)
+    #define TARGET(isa) __attribute__((target(isa)))
+  #else
+    #define TARGET(isa)
+  #endif
+#elif defined(__ARM_NEON) || defined(__aarch64__) || defined(_M_ARM64)
+  #define RENDERER_NEON
+  #include <arm_neon.h>
+#endif
+
 #define MAX_UNICODE 0x100000
 #define GLYPHSET_SIZE 256
 #define MAX_LOADABLE_GLYPHSETS (MAX_UNICODE / GLYPHSET_SIZE)
 #define SUBPIXEL_BITMAPS_CACHED 3
+#define GLYPH_ATLAS_PAGE_SIZE 1024
+#define GLYPH_ATLAS_MAX_PAGES 64
+#define GLYPH_ATLAS_SHELF_ROUND 4
+#define GLYPH_ATLAS_DEFAULT_LIMIT (32 * 1024 * 1024)
+// marks glyphs without a bitmap in the atlas, either because they're blank or
+// because they couldn't be rasterized, so they aren't queued again
+#define GLYPH_ATLAS_NONE -1
+// glyphs that found every page full are marked with the eviction count below
+// this, and queued again once pages were evicted, see glyph_atlas_no_room
+#define GLYPH_ATLAS_NO_ROOM -2
+#define GLYPH_QUEUE_INIT_SIZE 256
+// a power of two
+#define TEXT_WIDTH_CACHE_SIZE 4096
+// bump when the layout of glyph cache files or the way glyphs are rendered changes
+#define GLYPH_CACHE_VERSION 2
+#define GLYPH_CACHE_MAGIC 0x4347584C // "LXGC" on little-endian machines
+// the offset of bitmaps that weren't rasterized when the cache file was written
+#define GLYPH_CACHE_NOT_SAVED UINT32_MAX
+// glyph rows are expanded to this many pixels of coverage at a time
+#define BLEND_CHUNK 64
+// pixel sizes a font keeps the glyphs of, besides the one it is using
+#define FONT_SIZES_KEPT 4
+// used when the refresh rate of the display isn't known
+#define DEFAULT_REFRESH_RATE 60
+// frames ending this close to the next refresh are still presented at once
+#define PRESENT_SLACK 0.002
 
 RenWindow* window_renderer = NULL;
 static FT_Library library;
 
-// draw_rect_surface is used as a 1x1 surface to simplify ren_draw_rect with blending
-static SDL_Surface *draw_rect_surface;
+// serializes lazy glyph loading, as the rencache may rasterize from several threads
+static SDL_mutex *glyphset_mutex;
+// the fonts that weren't freed yet; Lua only frees them when it is closed,
+// after ren_free, so the glyph atlas, the rasterizer and glyphset_mutex are
+// kept until the last one is gone
+static int font_count;
+static bool renderer_freed;
 
 static void* check_alloc(void *ptr) {
   if (!ptr) {
@@ -36,32 +88,487 @@ static void* check_alloc(void *ptr) {
   return ptr;
 }
 
+// a word at a time multiplicative hash, continuing from a previous hash or
+// HASH_INITIAL; the high bits are the best mixed
+#define HASH_INITIAL 0xcbf29ce484222325ULL
+#define HASH_PRIME 0x9E3779B97F4A7C15ULL
+static uint64_t hash_bytes(uint64_t hash, const void *data, size_t size) {
+  const unsigned char *p = data;
+  for (; size >= 8; p += 8, size -= 8) {
+    uint64_t word;
+    memcpy(&word, p, sizeof(word));
+    hash = (((hash << 5) | (hash >> 59)) ^ word) * HASH_PRIME;
+  }
+  for (; size > 0; ++p, --size)
+    hash = (((hash << 5) | (hash >> 59)) ^ *p) * HASH_PRIME;
+  return hash;
+}
+
+// the pixel coordinate of a coordinate in points, rounded the same way
+// everywhere so that the scale can be fractional
+static inline int scale_coordinate(double value, float scale) {
+  return (int) floor(value * scale + 0.5);
+}
+
+/******************* Glyph blending **********************/
+
+// Glyphs are blended one row at a time: the coverage of each pixel is first
+// expanded into a word laid out like the destination pixel, then the color is
+// blended into every byte of the row according to the coverage of that byte.
+// Bytes without coverage, like the alpha channel, are left as they are.
+typedef void (*BlendRowFn)(uint32_t *dst, const uint32_t *coverage, int count, uint32_t color);
+
+// (color * k + dst * (255 - k)) / 255 on each byte, rounded. The scalar
+// version works on the even and the odd bytes of the word at once, as two
+// 16-bit lanes that can't overflow into each other.
+static void blend_row_scalar(uint32_t *dst, const uint32_t *coverage, int count, uint32_t color) {
+  for (int i = 0; i < count; ++i) {
+    uint32_t k = coverage[i], d = dst[i], inv_k = ~k;
+    if (!k)
+      continue;
+    uint32_t even = ((color & 0xFF) * (k & 0xFF) + (d & 0xFF) * (inv_k & 0xFF))
+                  | ((color >> 16 & 0xFF) * (k >> 16 & 0xFF) + (d >> 16 & 0xFF) * (inv_k >> 16 & 0xFF)) << 16;
+    uint32_t odd = ((color >> 8 & 0xFF) * (k >> 8 & 0xFF) + (d >> 8 & 0xFF) * (inv_k >> 8 & 0xFF))
+                 | ((color >> 24) * (k >> 24) + (d >> 24) * (inv_k >> 24)) << 16;
+    even += 0x00800080;
+    odd += 0x00800080;
+    even = ((even + (even >> 8 & 0x00FF00FF)) >> 8) & 0x00FF00FF;
+    odd = ((odd + (odd >> 8 & 0x00FF00FF)) >> 8) & 0x00FF00FF;
+    dst[i] = even | odd << 8;
+  }
+}
+
+#ifdef RENDERER_X86_SIMD
+// the same computation on 16-bit lanes, none of the intermediate values overflow
+TARGET("sse2") static inline __m128i blend_bytes_sse2(__m128i color, __m128i dst, __m128i k) {
+  __m128i v = _mm_add_epi16(_mm_mullo_epi16(color, k), _mm_mullo_epi16(dst, _mm_sub_epi16(_mm_set1_epi16(255), k)));
+  v = _mm_add_epi16(v, _mm_set1_epi16(128));
+  return _mm_srli_epi16(_mm_add_epi16(v, _mm_srli_epi16(v, 8)), 8);
+}
+
+TARGET("sse2") static void blend_row_sse2(uint32_t *dst, const uint32_t *coverage, int count, uint32_t color) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i c = _mm_unpacklo_epi8(_mm_set1_epi32(color), zero);
+  int i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m128i k = _mm_loadu_si128((const __m128i*) (coverage + i));
+    __m128i d = _mm_loadu_si128((const __m128i*) (dst + i));
+    __m128i lo = blend_bytes_sse2(c, _mm_unpacklo_epi8(d, zero), _mm_unpacklo_epi8(k, zero));
+    __m128i hi = blend_bytes_sse2(c, _mm_unpackhi_epi8(d, zero), _mm_unpackhi_epi8(k, zero));
+    _mm_storeu_si128((__m128i*) (dst + i), _mm_packus_epi16(lo, hi));
+  }
+  blend_row_scalar(dst + i, coverage + i, count - i, color);
+}
+
+TARGET("avx2") static inline __m256i blend_bytes_avx2(__m256i color, __m256i dst, __m256i k) {
+  __m256i v = _mm256_add_epi16(_mm256_mullo_epi16(color, k), _mm256_mullo_epi16(dst, _mm256_sub_epi16(_mm256_set1_epi16(255), k)));
+  v = _mm256_add_epi16(v, _mm256_set1_epi16(128));
+  return _mm256_srli_epi16(_mm256_add_epi16(v, _mm256_srli_epi16(v, 8)), 8);
+}
+
+TARGET("avx2") static void blend_row_avx2(uint32_t *dst, const uint32_t *coverage, int count, uint32_t color) {
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i c = _mm256_unpacklo_epi8(_mm256_set1_epi32(color), zero);
+  int i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256i k = _mm256_loadu_si256((const __m256i*) (coverage + i));
+    __m256i d = _mm256_loadu_si256((const __m256i*) (dst + i));
+    // unpacking and packing both work within 128-bit lanes, so the order is kept
+    __m256i lo = blend_bytes_avx2(c, _mm256_unpacklo_epi8(d, zero), _mm256_unpacklo_epi8(k, zero));
+    __m256i hi = blend_bytes_avx2(c, _mm256_unpackhi_epi8(d, zero), _mm256_unpackhi_epi8(k, zero));
+    _mm256_storeu_si256((__m256i*) (dst + i), _mm256_packus_epi16(lo, hi));
+  }
+  // the callers are compiled without AVX, avoid the transition penalty
+  _mm256_zeroupper();
+  const __m128i zero4 = _mm_setzero_si128();
+  const __m128i c4 = _mm_unpacklo_epi8(_mm_set1_epi32(color), zero4);
+  for (; i + 4 <= count; i += 4) {
+    __m128i k = _mm_loadu_si128((const __m128i*) (coverage + i));
+    __m128i d = _mm_loadu_si128((const __m128i*) (dst + i));
+    __m128i lo = blend_bytes_sse2(c4, _mm_unpacklo_epi8(d, zero4), _mm_unpacklo_epi8(k, zero4));
+    __m128i hi = blend_bytes_sse2(c4, _mm_unpackhi_epi8(d, zero4), _mm_unpackhi_epi8(k, zero4));
+    _mm_storeu_si128((__m128i*) (dst + i), _mm_packus_epi16(lo, hi));
+  }
+  blend_row_scalar(dst + i, coverage + i, count - i, color);
+}
+#endif
+
+#ifdef RENDERER_NEON
+static void blend_row_neon(uint32_t *dst, const uint32_t *coverage, int count, uint32_t color) {
+  const uint8x16_t c = vreinterpretq_u8_u32(vdupq_n_u32(color));
+  const uint16x8_t round = vdupq_n_u16(128);
+  int i = 0;
+  for (; i + 4 <= count; i += 4) {
+    uint8x16_t k = vreinterpretq_u8_u32(vld1q_u32(coverage + i));
+    uint8x16_t d = vreinterpretq_u8_u32(vld1q_u32(dst + i));
+    uint8x16_t inv_k = vmvnq_u8(k);
+    uint16x8_t lo = vaddq_u16(vmlal_u8(vmull_u8(vget_low_u8(c), vget_low_u8(k)), vget_low_u8(d), vget_low_u8(inv_k)), round);
+    uint16x8_t hi = vaddq_u16(vmlal_u8(vmull_u8(vget_high_u8(c), vget_high_u8(k)), vget_high_u8(d), vget_high_u8(inv_k)), round);
+    uint8x16_t out = vcombine_u8(vshrn_n_u16(vsraq_n_u16(lo, lo, 8), 8), vshrn_n_u16(vsraq_n_u16(hi, hi, 8), 8));
+    vst1q_u32(dst + i, vreinterpretq_u32_u8(out));
+  }
+  blend_row_scalar(dst + i, coverage + i, count - i, color);
+}
+#endif
+
+static BlendRowFn blend_row = blend_row_scalar;
+
+static void init_blend_row(void) {
+#ifdef RENDERER_X86_SIMD
+  if (SDL_HasAVX2())
+    blend_row = blend_row_avx2;
+  else if (SDL_HasSSE2())
+    blend_row = blend_row_sse2;
+#elif defined(RENDERER_NEON)
+  blend_row = blend_row_neon;
+#endif
+}
+
+// scales an 8-bit coverage by the alpha of the color
+static inline uint32_t coverage_alpha(uint32_t coverage, uint32_t alpha) {
+  uint32_t v = coverage * alpha + 128;
+  return (v + (v >> 8)) >> 8;
+}
+
+// The parts that depend on where the channels are in a pixel: expanding glyph
+// coverage and packing colors. They're specialized with constant shifts for
+// the 32-bit formats used by the window surfaces, and picked once per call
+// from the format of the surface; other formats use the shifts of the format.
+typedef struct {
+  void (*expand_gray)(uint32_t *coverage, const uint8_t *src, int count, uint32_t alpha, const SDL_PixelFormat *format);
+  void (*expand_subpixel)(uint32_t *coverage, const uint8_t *src, int count, uint32_t alpha, const SDL_PixelFormat *format);
+  // the color channels only, the alpha byte is left at 0
+  uint32_t (*pack)(RenColor color, const SDL_PixelFormat *format);
+} PixelOps;
+
+static inline void expand_gray(uint32_t *coverage, const uint8_t *src, int count, uint32_t alpha, int rshift, int gshift, int bshift) {
+  const uint32_t channels = 1u << rshift | 1u << gshift | 1u << bshift;
+  if (alpha == 0xFF) {
+    for (int i = 0; i < count; ++i)
+      coverage[i] = src[i] * channels;
+  } else {
+    for (int i = 0; i < count; ++i)
+      coverage[i] = coverage_alpha(src[i], alpha) * channels;
+  }
+}
+
+static inline void expand_subpixel(uint32_t *coverage, const uint8_t *src, int count, uint32_t alpha, int rshift, int gshift, int bshift) {
+  if (alpha == 0xFF) {
+    for (int i = 0; i < count; ++i, src += 3)
+      coverage[i] = (uint32_t) src[0] << rshift | (uint32_t) src[1] << gshift | (uint32_t) src[2] << bshift;
+  } else {
+    for (int i = 0; i < count; ++i, src += 3)
+      coverage[i] = coverage_alpha(src[0], alpha) << rshift | coverage_alpha(src[1], alpha) << gshift | coverage_alpha(src[2], alpha) << bshift;
+  }
+}
+
+static inline uint32_t pack_color(RenColor color, int rshift, int gshift, int bshift) {
+  return (uint32_t) color.r << rshift | (uint32_t) color.g << gshift | (uint32_t) color.b << bshift;
+}
+
+// ARGB8888 and XRGB8888, the layout of BGRA32 on little-endian machines
+static void expand_gray_xrgb(uint32_t *coverage, const uint8_t *src, int count, uint32_t alpha, UNUSED const SDL_PixelFormat *format) {
+  expand_gray(coverage, src, count, alpha, 16, 8, 0);
+}
+static void expand_subpixel_xrgb(uint32_t *coverage, const uint8_t *src, int count, uint32_t alpha, UNUSED const SDL_PixelFormat *format) {
+  expand_subpixel(coverage, src, count, alpha, 16, 8, 0);
+}
+static uint32_t pack_xrgb(RenColor color, UNUSED const SDL_PixelFormat *format) {
+  return pack_color(color, 16, 8, 0);
+}
+
+// ABGR8888 and XBGR8888
+static void expand_gray_xbgr(uint32_t *coverage, const uint8_t *src, int count, uint32_t alpha, UNUSED const SDL_PixelFormat *format) {
+  expand_gray(coverage, src, count, alpha, 0, 8, 16);
+}
+static void expand_subpixel_xbgr(uint32_t *coverage, const uint8_t *src, int count, uint32_t alpha, UNUSED const SDL_PixelFormat *format) {
+  expand_subpixel(coverage, src, count, alpha, 0, 8, 16);
+}
+static uint32_t pack_xbgr(RenColor color, UNUSED const SDL_PixelFormat *format) {
+  return pack_color(color, 0, 8, 16);
+}
+
+static void expand_gray_generic(uint32_t *coverage, const uint8_t *src, int count, uint32_t alpha, const SDL_PixelFormat *format) {
+  expand_gray(coverage, src, count, alpha, format->Rshift, format->Gshift, format->Bshift);
+}
+static void expand_subpixel_generic(uint32_t *coverage, const uint8_t *src, int count, uint32_t alpha, const SDL_PixelFormat *format) {
+  expand_subpixel(coverage, src, count, alpha, format->Rshift, format->Gshift, format->Bshift);
+}
+static uint32_t pack_generic(RenColor color, const SDL_PixelFormat *format) {
+  return pack_color(color, format->Rshift, format->Gshift, format->Bshift);
+}
+
+static const PixelOps pixel_ops_xrgb = { expand_gray_xrgb, expand_subpixel_xrgb, pack_xrgb };
+static const PixelOps pixel_ops_xbgr = { expand_gray_xbgr, expand_subpixel_xbgr, pack_xbgr };
+static const PixelOps pixel_ops_generic = { expand_gray_generic, expand_subpixel_generic, pack_generic };
+
+static const PixelOps* get_pixel_ops(const SDL_PixelFormat *format) {
+  switch (format->format) {
+    case SDL_PIXELFORMAT_ARGB8888:
+    case SDL_PIXELFORMAT_RGB888:
+      return &pixel_ops_xrgb;
+    case SDL_PIXELFORMAT_ABGR8888:
+    case SDL_PIXELFORMAT_BGR888:
+      return &pixel_ops_xbgr;
+    default:
+      return &pixel_ops_generic;
+  }
+}
+
 /************************* Fonts *************************/
 
+enum { GLYPH_UNKNOWN, GLYPH_MISSING, GLYPH_LOADED };
+
+// The layout of glyph cache files: a header, the key the file was written
+// for, the glyphs sorted by codepoint and then their bitmaps, stored the way
+// they are in the atlas. Offsets are from the start of the file.
 typedef struct {
-  unsigned int x0, x1, y0, y1, loaded;
-  int bitmap_left, bitmap_top;
+  uint32_t magic, version;
+  uint32_t key_size, glyph_count;
+} GlyphCacheHeader;
+
+typedef struct {
+  uint32_t offset;
+  uint16_t width, rows;
+  int16_t bitmap_left, bitmap_top;
+} GlyphCacheBitmap;
+
+typedef struct {
+  uint32_t codepoint, glyph_index;
+  int32_t left, right;
+  float xadvance;
+  GlyphCacheBitmap bitmaps[SUBPIXEL_BITMAPS_CACHED];
+} GlyphCacheRecord;
+
+typedef struct {
+  const uint8_t *data;
+  size_t size;
+#ifdef _WIN32
+  HANDLE mapping;
+#endif
+} MappedFile;
+
+typedef struct {
+  MappedFile file;
+  const GlyphCacheRecord *records;
+  uint32_t count;
+  // where the cache of the font is written when it gained glyphs, NULL when disabled
+  char *path, *key;
+  bool dirty;
+} GlyphCache;
+
+// a font file mapped in memory, shared by the fonts loaded from it
+typedef struct FontFile {
+  struct FontFile* next;
+  MappedFile file;
+  int refs;
+  char path[];
+} FontFile;
+
+typedef struct {
+  // GLYPH_UNKNOWN until the metrics were looked up, the rest is only valid after that
+  SDL_atomic_t status;
+  // where the bitmap was rasterized in the atlas, 0 when it wasn't
+  SDL_atomic_t resident;
+  unsigned int glyph_index, loaded, queued;
+  // horizontal extent around the pen, a pixel wider on each side than the
+  // outline to account for the subpixel offset and the filtering
+  int left, right;
   float xadvance;
+  // the outline of the glyph, shared with the other subpixel offsets and
+  // owned by the first one; glyphs read from the cache file have none
+  FT_Glyph outline;
+  // the bitmap in the cache file, if the glyph was read from it
+  const GlyphCacheBitmap* cached;
+  // the bitmap, only valid once the glyph is resident
+  unsigned short width, rows;
+  unsigned short atlas_x, atlas_y;
+  int bitmap_left, bitmap_top;
 } GlyphMetric;
 
 typedef struct {
-  SDL_Surface* surface;
+  int subpixel_idx;
   GlyphMetric metrics[GLYPHSET_SIZE];
 } GlyphSet;
 
+// The glyphs of a font at a pixel size it used before, kept along with the
+// FreeType size so that going back to it, when zooming or when the window
+// moves to a monitor with another scale, doesn't load them again.
+typedef struct {
+  // NULL when the slot is free
+  FT_Size ft_size;
+  int pixel_size;
+  GlyphSet* (*sets)[MAX_LOADABLE_GLYPHSETS];
+  GlyphCache cache;
+  float space_advance, monospace_advance;
+  unsigned int last_used;
+} FontSize;
+
 typedef struct RenFont {
   FT_Face face;
+  // the face is read from the mapped file, or streamed when it can't be mapped
+  FontFile* file;
   FT_StreamRec stream;
-  GlyphSet* sets[SUBPIXEL_BITMAPS_CACHED][MAX_LOADABLE_GLYPHSETS];
+  // the glyphs at the current pixel size, by subpixel offset and glyphset
+  GlyphSet* (*sets)[MAX_LOADABLE_GLYPHSETS];
   float size, space_advance, tab_advance;
-  unsigned short max_height, baseline, height;
+  // the advance shared by all the printable ASCII glyphs of monospace fonts, 0 otherwise
+  float monospace_advance;
+  int pixel_size;
+  // the last pixel size the face couldn't be used at, so it isn't tried again
+  int unusable_pixel_size;
+  unsigned short baseline, height;
   ERenFontAntialiasing antialiasing;
   ERenFontHinting hinting;
   unsigned char style;
   unsigned short underline_thickness;
+  GlyphCache cache;
+  FontSize sizes[FONT_SIZES_KEPT];
   char path[];
 } RenFont;
 
+/******************* Glyph atlas **********************/
+
+// The bitmaps of all the fonts are packed in shelves on a few shared pages,
+// one glyph at a time when it is first drawn. Pages are evicted as a whole,
+// least recently used first, once the atlas grows past its size limit;
+// evicting bumps the generation of the page so the glyphs that were on it
+// get rasterized again the next time they're drawn.
+// Pages are only evicted between frames, when nothing is being drawn, so the
+// render threads can read resident glyphs without taking the lock.
+typedef struct {
+  unsigned short y, height, x;
+} GlyphAtlasShelf;
+
+typedef struct {
+  uint8_t *pixels;
+  int bytes_per_pixel, generation;
+  int shelf_count, shelf_end;
+  SDL_atomic_t last_used;
+  GlyphAtlasShelf shelves[GLYPH_ATLAS_PAGE_SIZE / GLYPH_ATLAS_SHELF_ROUND];
+} GlyphAtlasPage;
+
+static struct {
+  GlyphAtlasPage pages[GLYPH_ATLAS_MAX_PAGES];
+  size_t size, limit;
+  int frame, evictions;
+  // set when a glyph found no room, to evict a page even under the limit
+  SDL_atomic_t starved;
+} glyph_atlas = { .limit = GLYPH_ATLAS_DEFAULT_LIMIT };
+
+static bool glyph_atlas_place(GlyphAtlasPage *page, int width, int height, unsigned short *x, unsigned short *y) {
+  GlyphAtlasShelf *best = NULL;
+  for (int i = 0; i < page->shelf_count; ++i) {
+    GlyphAtlasShelf *shelf = &page->shelves[i];
+    // don't waste more than a third of a shelf on short glyphs
+    if (shelf->height >= height && shelf->height * 2 <= height * 3 + GLYPH_ATLAS_SHELF_ROUND * 2
+        && shelf->x + width <= GLYPH_ATLAS_PAGE_SIZE && (!best || shelf->height < best->height))
+      best = shelf;
+  }
+  if (!best) {
+    int shelf_height = (height + GLYPH_ATLAS_SHELF_ROUND - 1) / GLYPH_ATLAS_SHELF_ROUND * GLYPH_ATLAS_SHELF_ROUND;
+    if (page->shelf_end + shelf_height > GLYPH_ATLAS_PAGE_SIZE)
+      return false;
+    best = &page->shelves[page->shelf_count++];
+    *best = (GlyphAtlasShelf) { page->shelf_end, shelf_height, 0 };
+    page->shelf_end += shelf_height;
+  }
+  *x = best->x;
+  *y = best->y;
+  best->x += width;
+  return true;
+}
+
+// a glyph is resident while the generation of its page is unchanged
+static inline int glyph_atlas_resident(int page_idx) {
+  return glyph_atlas.pages[page_idx].generation * GLYPH_ATLAS_MAX_PAGES + page_idx + 1;
+}
+
+static inline bool glyph_atlas_is_resident(int resident) {
+  return resident > 0 && resident == glyph_atlas_resident((resident - 1) % GLYPH_ATLAS_MAX_PAGES);
+}
+
+// a glyph that found no room waits until pages are evicted, which changes this
+static inline int glyph_atlas_no_room(void) {
+  return GLYPH_ATLAS_NO_ROOM - (glyph_atlas.evictions & 0xffffff);
+}
+
+// finds room for a bitmap, adding a page if needed; called with glyphset_mutex held
+static GlyphAtlasPage* glyph_atlas_alloc(int width, int height, int bytes_per_pixel, int *page_idx, unsigned short *x, unsigned short *y) {
+  if (width > GLYPH_ATLAS_PAGE_SIZE || height > GLYPH_ATLAS_PAGE_SIZE)
+    return NULL;
+  int free_page = -1;
+  for (int i = 0; i < GLYPH_ATLAS_MAX_PAGES; ++i) {
+    GlyphAtlasPage *page = &glyph_atlas.pages[i];
+    if (!page->pixels) {
+      if (free_page == -1)
+        free_page = i;
+    } else if (page->bytes_per_pixel == bytes_per_pixel && glyph_atlas_place(page, width, height, x, y)) {
+      *page_idx = i;
+      return page;
+    }
+  }
+  // over the limit the atlas grows anyway, it is trimmed at the end of the frame
+  if (free_page == -1)
+    return NULL;
+  GlyphAtlasPage *page = &glyph_atlas.pages[free_page];
+  size_t page_size = (size_t) GLYPH_ATLAS_PAGE_SIZE * GLYPH_ATLAS_PAGE_SIZE * bytes_per_pixel;
+  page->pixels = check_alloc(malloc(page_size));
+  page->bytes_per_pixel = bytes_per_pixel;
+  page->shelf_count = page->shelf_end = 0;
+  SDL_AtomicSet(&page->last_used, glyph_atlas.frame);
+  glyph_atlas.size += page_size;
+  glyph_atlas_place(page, width, height, x, y);
+  *page_idx = free_page;
+  return page;
+}
+
+static void glyph_atlas_evict(GlyphAtlasPage *page) {
+  glyph_atlas.size -= (size_t) GLYPH_ATLAS_PAGE_SIZE * GLYPH_ATLAS_PAGE_SIZE * page->bytes_per_pixel;
+  free(page->pixels);
+  page->pixels = NULL;
+  page->generation++;
+}
+
+// called between frames: evicts the pages that weren't used recently until
+// the atlas fits in its limit again. When a glyph found all the pages taken,
+// the least recently used page is evicted even if the last frame used it, the
+// frame is already drawn and its glyphs get rasterized again if needed.
+static void glyph_atlas_end_frame(void) {
+  SDL_LockMutex(glyphset_mutex);
+  bool starved = SDL_AtomicSet(&glyph_atlas.starved, 0);
+  int evicted = 0;
+  while (glyph_atlas.size > glyph_atlas.limit || (starved && !evicted)) {
+    GlyphAtlasPage *oldest = NULL;
+    for (int i = 0; i < GLYPH_ATLAS_MAX_PAGES; ++i) {
+      GlyphAtlasPage *page = &glyph_atlas.pages[i];
+      if (page->pixels && (SDL_AtomicGet(&page->last_used) != glyph_atlas.frame || (starved && !evicted))
+          && (!oldest || SDL_AtomicGet(&page->last_used) - SDL_AtomicGet(&oldest->last_used) < 0))
+        oldest = page;
+    }
+    // everything left was used by the last frame
+    if (!oldest)
+      break;
+    glyph_atlas_evict(oldest);
+    evicted++;
+  }
+  if (evicted)
+    glyph_atlas.evictions++;
+  glyph_atlas.frame++;
+  SDL_UnlockMutex(glyphset_mutex);
+}
+
+static void glyph_atlas_free(void) {
+  for (int i = 0; i < GLYPH_ATLAS_MAX_PAGES; ++i) {
+    if (glyph_atlas.pages[i].pixels)
+      glyph_atlas_evict(&glyph_atlas.pages[i]);
+  }
+}
+
+void ren_set_glyph_cache_size(size_t size) {
+  glyph_atlas.limit = size;
+}
+
 static const char* utf8_to_codepoint(const char *p, unsigned *dst) {
   const unsigned char *up = (unsigned char*)p;
   unsigned res, n;
@@ -120,67 +627,687 @@ static int font_set_style(FT_Outline* outline, int x_translation, unsigned char
   return 0;
 }
 
-static void font_load_glyphset(RenFont* font, int idx) {
-  unsigned int render_option = font_set_render_options(font), load_option = font_set_load_options(font);
+// renders the outline of a glyph at a subpixel offset, the bitmap has to be
+// freed with FT_Done_Glyph
+static FT_BitmapGlyph font_render_glyph(RenFont* font, FT_Glyph outline, int subpixel_idx) {
+  unsigned int render_option = font_set_render_options(font);
   int bitmaps_cached = font->antialiasing == FONT_ANTIALIASING_SUBPIXEL ? SUBPIXEL_BITMAPS_CACHED : 1;
+  FT_Glyph glyph;
+  if (!outline || FT_Glyph_Copy(outline, &glyph))
+    return NULL;
+  if (glyph->format == FT_GLYPH_FORMAT_OUTLINE)
+    font_set_style(&((FT_OutlineGlyph) glyph)->outline, (64 / bitmaps_cached) * subpixel_idx, font->style);
+  if (FT_Glyph_To_Bitmap(&glyph, render_option, NULL, true)) {
+    FT_Done_Glyph(glyph);
+    return NULL;
+  }
+  return (FT_BitmapGlyph) glyph;
+}
+
+// copies the rows of the bitmap of a glyph into the cache or the atlas,
+// monochrome bitmaps are expanded to a byte per pixel
+static void font_copy_bitmap(uint8_t* target, int pitch, const FT_Bitmap* bitmap) {
+  for (unsigned int line = 0; line < bitmap->rows; ++line, target += pitch) {
+    const uint8_t* source = &bitmap->buffer[line * bitmap->pitch];
+    if (bitmap->pixel_mode == FT_PIXEL_MODE_MONO) {
+      for (unsigned int column = 0; column < bitmap->width; ++column)
+        target[column] = ((source[column / 8] >> (7 - (column % 8))) & 0x1) * 0xFF;
+    } else
+      memcpy(target, source, bitmap->width);
+  }
+}
+
+/************************* Files *************************/
+
+static bool mapped_file_open(MappedFile* file, const char* path) {
+  memset(file, 0, sizeof(MappedFile));
+#ifdef _WIN32
+  LPWSTR wpath = utfconv_utf8towc(path);
+  if (!wpath)
+    return false;
+  HANDLE handle = CreateFileW(wpath, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  free(wpath);
+  if (handle == INVALID_HANDLE_VALUE)
+    return false;
+  LARGE_INTEGER size;
+  if (GetFileSizeEx(handle, &size) && size.QuadPart > 0 && (uint64_t) size.QuadPart <= SIZE_MAX) {
+    file->mapping = CreateFileMappingW(handle, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (file->mapping && (file->data = MapViewOfFile(file->mapping, FILE_MAP_READ, 0, 0, 0)))
+      file->size = (size_t) size.QuadPart;
+    else if (file->mapping) {
+      CloseHandle(file->mapping);
+      file->mapping = NULL;
+    }
+  }
+  CloseHandle(handle);
+#else
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    return false;
+  struct stat info;
+  if (fstat(fd, &info) == 0 && info.st_size > 0 && (uint64_t) info.st_size <= SIZE_MAX) {
+    void* data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data != MAP_FAILED) {
+      file->data = data;
+      file->size = info.st_size;
+    }
+  }
+  close(fd);
+#endif
+  return file->data != NULL;
+}
+
+static void mapped_file_close(MappedFile* file) {
+  if (file->data) {
+#ifdef _WIN32
+    UnmapViewOfFile(file->data);
+    CloseHandle(file->mapping);
+#else
+    munmap((void*) file->data, file->size);
+#endif
+  }
+  memset(file, 0, sizeof(MappedFile));
+}
+
+static bool get_file_info(const char* path, long long* mtime, long long* size) {
+#ifdef _WIN32
+  struct _stat info;
+  LPWSTR wpath = utfconv_utf8towc(path);
+  if (!wpath)
+    return false;
+  int err = _wstat(wpath, &info);
+  free(wpath);
+#else
+  struct stat info;
+  int err = stat(path, &info);
+#endif
+  if (err < 0)
+    return false;
+  *mtime = info.st_mtime;
+  *size = info.st_size;
+  return true;
+}
+
+// writes next to the destination and moves the file over it, so that other
+// instances never map a file that is half written
+static bool write_file_replace(const char* path, const void* data, size_t size) {
+  size_t tmp_path_size = strlen(path) + 32;
+  char* tmp_path = check_alloc(malloc(tmp_path_size));
+#ifdef _WIN32
+  snprintf(tmp_path, tmp_path_size, "%s.%lu.tmp", path, (unsigned long) GetCurrentProcessId());
+#else
+  snprintf(tmp_path, tmp_path_size, "%s.%lu.tmp", path, (unsigned long) getpid());
+#endif
+  SDL_RWops* file = SDL_RWFromFile(tmp_path, "wb");
+  if (!file) {
+    free(tmp_path);
+    return false;
+  }
+  bool written = SDL_RWwrite(file, data, 1, size) == size;
+  written = SDL_RWclose(file) == 0 && written;
+#ifdef _WIN32
+  LPWSTR wtmp_path = utfconv_utf8towc(tmp_path), wpath = utfconv_utf8towc(path);
+  bool moved = written && wtmp_path && wpath && MoveFileExW(wtmp_path, wpath, MOVEFILE_REPLACE_EXISTING);
+  if (!moved && wtmp_path)
+    DeleteFileW(wtmp_path);
+  free(wtmp_path);
+  free(wpath);
+#else
+  bool moved = written && rename(tmp_path, path) == 0;
+  if (!moved)
+    unlink(tmp_path);
+#endif
+  free(tmp_path);
+  return moved;
+}
+
+static void make_dir(const char* path) {
+#ifdef _WIN32
+  LPWSTR wpath = utfconv_utf8towc(path);
+  if (wpath)
+    CreateDirectoryW(wpath, NULL);
+  free(wpath);
+#else
+  mkdir(path, 0755);
+#endif
+}
+
+/******************* Glyph cache files **********************/
+
+// The glyphs a font used are saved along with the bitmaps it rasterized when
+// the font is freed, and mapped back in when the same font is loaded again: their metrics
+// and bitmaps are then read from the file instead of FreeType, so the text of
+// the first frame doesn't wait on the rasterizer. Files are named after a hash
+// of their key, which holds everything the glyphs depend on, and are ignored
+// unless the key stored in them matches.
+static char* glyph_cache_dir;
+
+static size_t font_cache_records_offset(size_t key_size) {
+  return sizeof(GlyphCacheHeader) + (key_size + 3) / 4 * 4;
+}
+
+// checks that the mapped file was written for the key of the font and that
+// everything it points to is inside of it
+static bool font_cache_validate(RenFont* font) {
+  GlyphCache* cache = &font->cache;
   unsigned int byte_width = font->antialiasing == FONT_ANTIALIASING_SUBPIXEL ? 3 : 1;
-  for (int j = 0, pen_x = 0; j < bitmaps_cached; ++j) {
-    GlyphSet* set = check_alloc(calloc(1, sizeof(GlyphSet)));
-    font->sets[j][idx] = set;
-    for (int i = 0; i < GLYPHSET_SIZE; ++i) {
-      int glyph_index = FT_Get_Char_Index(font->face, i + idx * GLYPHSET_SIZE);
-      if (!glyph_index || FT_Load_Glyph(font->face, glyph_index, load_option | FT_LOAD_BITMAP_METRICS_ONLY)
-        || font_set_style(&font->face->glyph->outline, j * (64 / SUBPIXEL_BITMAPS_CACHED), font->style) || FT_Render_Glyph(font->face->glyph, render_option)) {
+  const GlyphCacheHeader* header = (const GlyphCacheHeader*) cache->file.data;
+  size_t size = cache->file.size, key_size = strlen(cache->key);
+  size_t records_offset = font_cache_records_offset(key_size);
+  if (size < records_offset || header->magic != GLYPH_CACHE_MAGIC || header->version != GLYPH_CACHE_VERSION
+      || header->key_size != key_size || memcmp(header + 1, cache->key, key_size) != 0
+      || header->glyph_count > (size - records_offset) / sizeof(GlyphCacheRecord))
+    return false;
+  const GlyphCacheRecord* records = (const GlyphCacheRecord*) (cache->file.data + records_offset);
+  for (uint32_t i = 0; i < header->glyph_count; ++i) {
+    for (int j = 0; j < SUBPIXEL_BITMAPS_CACHED; ++j) {
+      const GlyphCacheBitmap* bitmap = &records[i].bitmaps[j];
+      if (bitmap->offset == GLYPH_CACHE_NOT_SAVED)
         continue;
-      }
-      FT_GlyphSlot slot = font->face->glyph;
-      unsigned int glyph_width = slot->bitmap.width / byte_width;
-      if (font->antialiasing == FONT_ANTIALIASING_NONE)
-        glyph_width *= 8;
-      set->metrics[i] = (GlyphMetric){ pen_x, pen_x + glyph_width, 0, slot->bitmap.rows, true, slot->bitmap_left, slot->bitmap_top, (slot->advance.x + slot->lsb_delta - slot->rsb_delta) / 64.0f};
-      pen_x += glyph_width;
-      font->max_height = slot->bitmap.rows > font->max_height ? slot->bitmap.rows : font->max_height;
-      // In order to fix issues with monospacing; we need the unhinted xadvance; as FreeType doesn't correctly report the hinted advance for spaces on monospace fonts (like RobotoMono). See #843.
-      if (!glyph_index || FT_Load_Glyph(font->face, glyph_index, (load_option | FT_LOAD_BITMAP_METRICS_ONLY | FT_LOAD_NO_HINTING) & ~FT_LOAD_FORCE_AUTOHINT)
-        || font_set_style(&font->face->glyph->outline, j * (64 / SUBPIXEL_BITMAPS_CACHED), font->style) || FT_Render_Glyph(font->face->glyph, render_option)) {
+      if (bitmap->offset > size || (size_t) bitmap->width * bitmap->rows * byte_width > size - bitmap->offset)
+        return false;
+    }
+  }
+  cache->records = records;
+  cache->count = header->glyph_count;
+  return true;
+}
+
+// maps the cache file of the font for its current pixel size, if there is one
+static void font_cache_open(RenFont* font) {
+  GlyphCache* cache = &font->cache;
+  long long mtime, file_size;
+  if (!glyph_cache_dir || !get_file_info(font->path, &mtime, &file_size))
+    return;
+  FT_Int major, minor, patch;
+  FT_Library_Version(library, &major, &minor, &patch);
+  const char* key_format = "%s\n%lld %lld\n%d %d %d %d\nfreetype %d.%d.%d";
+  int key_size = snprintf(NULL, 0, key_format, font->path, mtime, file_size, font->pixel_size,
+    font->antialiasing, font->hinting, font->style, major, minor, patch);
+  cache->key = check_alloc(malloc(key_size + 1));
+  snprintf(cache->key, key_size + 1, key_format, font->path, mtime, file_size, font->pixel_size,
+    font->antialiasing, font->hinting, font->style, major, minor, patch);
+  uint64_t hash = hash_bytes(HASH_INITIAL, cache->key, key_size);
+  size_t path_size = strlen(glyph_cache_dir) + 32;
+  cache->path = check_alloc(malloc(path_size));
+  snprintf(cache->path, path_size, "%s/%016llx.glyphs", glyph_cache_dir, (unsigned long long) hash);
+  if (mapped_file_open(&cache->file, cache->path) && !font_cache_validate(font)) {
+    mapped_file_close(&cache->file);
+    cache->records = NULL;
+    cache->count = 0;
+  }
+}
+
+static const GlyphCacheRecord* font_cache_find(GlyphCache* cache, unsigned int codepoint) {
+  uint32_t low = 0, high = cache->count;
+  while (low < high) {
+    uint32_t mid = low + (high - low) / 2;
+    if (cache->records[mid].codepoint < codepoint)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+  return low < cache->count && cache->records[low].codepoint == codepoint ? &cache->records[low] : NULL;
+}
+
+// whether the bitmap of a glyph at a subpixel offset can be saved, because it
+// is in the atlas, came from the cache file or is blank; called with
+// glyphset_mutex held
+static bool font_cache_has_bitmap(GlyphSet* set, int j) {
+  if (!set)
+    return false;
+  int resident = SDL_AtomicGet(&set->metrics[j].resident);
+  return set->metrics[j].cached || resident == GLYPH_ATLAS_NONE || glyph_atlas_is_resident(resident);
+}
+
+// whether a glyph the font loaded at a size goes in its cache file: it needs a
+// bitmap to save at one subpixel offset at least, the others are left to be
+// rasterized again. The advance of tabs depends on the tab size, and
+// codepoints past MAX_UNICODE share the glyphsets of lower ones, so neither is
+// saved.
+static bool font_cache_saves(RenFont* font, GlyphSet* (*sets)[MAX_LOADABLE_GLYPHSETS], int bitmaps_cached, int i, int j) {
+  GlyphMetric* metric = &sets[0][i]->metrics[j];
+  unsigned int codepoint = i * GLYPHSET_SIZE + j;
+  if (SDL_AtomicGet(&metric->status) != GLYPH_LOADED || !metric->loaded || codepoint == '\t'
+      || FT_Get_Char_Index(font->face, codepoint) != metric->glyph_index)
+    return false;
+  for (int k = 0; k < bitmaps_cached; ++k) {
+    if (font_cache_has_bitmap(sets[k][i], j))
+      return true;
+  }
+  return false;
+}
+
+// Lays out the cache file of the glyphs the font loaded at a size, copying
+// their bitmaps from the atlas or the cache file; nothing is rendered again.
+// Called with glyphset_mutex held.
+static uint8_t* font_cache_serialize(RenFont* font, GlyphSet* (*sets)[MAX_LOADABLE_GLYPHSETS], GlyphCache* cache, size_t* size) {
+  int bitmaps_cached = font->antialiasing == FONT_ANTIALIASING_SUBPIXEL ? SUBPIXEL_BITMAPS_CACHED : 1;
+  unsigned int byte_width = font->antialiasing == FONT_ANTIALIASING_SUBPIXEL ? 3 : 1;
+  uint32_t count = 0;
+  for (int i = 0; i < MAX_LOADABLE_GLYPHSETS; ++i) {
+    for (int j = 0; sets[0][i] && j < GLYPHSET_SIZE; ++j) {
+      if (font_cache_saves(font, sets, bitmaps_cached, i, j))
+        count++;
+    }
+  }
+  size_t key_size = strlen(cache->key), records_offset = font_cache_records_offset(key_size);
+  size_t used = records_offset + count * sizeof(GlyphCacheRecord), capacity = used * 4;
+  uint8_t* data = check_alloc(calloc(1, capacity));
+  *(GlyphCacheHeader*) data = (GlyphCacheHeader) { GLYPH_CACHE_MAGIC, GLYPH_CACHE_VERSION, key_size, count };
+  memcpy(data + sizeof(GlyphCacheHeader), cache->key, key_size);
+  uint32_t saved = 0;
+  for (int i = 0; i < MAX_LOADABLE_GLYPHSETS && saved < count; ++i) {
+    for (int j = 0; sets[0][i] && j < GLYPHSET_SIZE && saved < count; ++j) {
+      if (!font_cache_saves(font, sets, bitmaps_cached, i, j))
         continue;
+      GlyphMetric* metric = &sets[0][i]->metrics[j];
+      GlyphCacheRecord record = { i * GLYPHSET_SIZE + j, metric->glyph_index, metric->left, metric->right, metric->xadvance };
+      for (int k = 0; k < bitmaps_cached; ++k) {
+        if (!font_cache_has_bitmap(sets[k][i], j)) {
+          record.bitmaps[k].offset = GLYPH_CACHE_NOT_SAVED;
+          continue;
+        }
+        GlyphMetric* offset_metric = &sets[k][i]->metrics[j];
+        const GlyphCacheBitmap* cached = offset_metric->cached;
+        int resident = SDL_AtomicGet(&offset_metric->resident);
+        const uint8_t* source = NULL;
+        int source_pitch = 0;
+        GlyphCacheBitmap* bitmap = &record.bitmaps[k];
+        if (cached) {
+          *bitmap = *cached;
+          source = cache->file.data + cached->offset;
+          source_pitch = cached->width * byte_width;
+        } else if (resident != GLYPH_ATLAS_NONE) {
+          GlyphAtlasPage* page = &glyph_atlas.pages[(resident - 1) % GLYPH_ATLAS_MAX_PAGES];
+          *bitmap = (GlyphCacheBitmap) { 0, offset_metric->width, offset_metric->rows, offset_metric->bitmap_left, offset_metric->bitmap_top };
+          source_pitch = GLYPH_ATLAS_PAGE_SIZE * byte_width;
+          source = &page->pixels[offset_metric->atlas_y * source_pitch + offset_metric->atlas_x * byte_width];
+        }
+        bitmap->offset = used;
+        size_t row_size = (size_t) bitmap->width * byte_width, bitmap_size = row_size * bitmap->rows;
+        if (used + bitmap_size > capacity) {
+          capacity = (used + bitmap_size) * 2;
+          data = check_alloc(realloc(data, capacity));
+        }
+        for (unsigned int line = 0; source && line < bitmap->rows; ++line)
+          memcpy(data + used + line * row_size, source + line * source_pitch, row_size);
+        used += bitmap_size;
       }
-      slot = font->face->glyph;
-      set->metrics[i].xadvance = slot->advance.x / 64.0f;
+      memcpy(data + records_offset + saved++ * sizeof(GlyphCacheRecord), &record, sizeof(GlyphCacheRecord));
     }
-    if (pen_x == 0)
-      continue;
-    set->surface = check_alloc(SDL_CreateRGBSurface(0, pen_x, font->max_height, font->antialiasing == FONT_ANTIALIASING_SUBPIXEL ? 24 : 8, 0, 0, 0, 0));
-    uint8_t* pixels = set->surface->pixels;
-    for (int i = 0; i < GLYPHSET_SIZE; ++i) {
-      int glyph_index = FT_Get_Char_Index(font->face, i + idx * GLYPHSET_SIZE);
-      if (!glyph_index || FT_Load_Glyph(font->face, glyph_index, load_option))
-        continue;
-      FT_GlyphSlot slot = font->face->glyph;
-      font_set_style(&slot->outline, (64 / bitmaps_cached) * j, font->style);
-      if (FT_Render_Glyph(slot, render_option))
-        continue;
-      for (unsigned int line = 0; line < slot->bitmap.rows; ++line) {
-        int target_offset = set->surface->pitch * line + set->metrics[i].x0 * byte_width;
-        int source_offset = line * slot->bitmap.pitch;
-        if (font->antialiasing == FONT_ANTIALIASING_NONE) {
-          for (unsigned int column = 0; column < slot->bitmap.width; ++column) {
-            int current_source_offset = source_offset + (column / 8);
-            int source_pixel = slot->bitmap.buffer[current_source_offset];
-            pixels[++target_offset] = ((source_pixel >> (7 - (column % 8))) & 0x1) * 0xFF;
-          }
-        } else
-          memcpy(&pixels[target_offset], &slot->bitmap.buffer[source_offset], slot->bitmap.width);
+  }
+  *size = used;
+  return data;
+}
+
+void ren_set_font_cache_dir(const char* path) {
+  free(glyph_cache_dir);
+  glyph_cache_dir = NULL;
+  if (path) {
+    glyph_cache_dir = check_alloc(malloc(strlen(path) + 1));
+    strcpy(glyph_cache_dir, path);
+  }
+}
+
+// called with glyphset_mutex held
+static GlyphSet* font_alloc_glyphset(RenFont* font, int subpixel_idx, int idx) {
+  GlyphSet** slot = &font->sets[subpixel_idx][idx];
+  if (!*slot) {
+    GlyphSet* set = check_alloc(calloc(1, sizeof(GlyphSet)));
+    set->subpixel_idx = subpixel_idx;
+    SDL_AtomicSetPtr((void**)slot, set);
+  }
+  return *slot;
+}
+
+// Looks up the metrics of a glyph for all the subpixel offsets at once,
+// without rendering it: they're read from the cache file when the glyph is in
+// it, otherwise the glyph is loaded once, its outline is kept for the
+// rasterizer, and the unhinted advance comes from FT_Get_Advance.
+// Called with glyphset_mutex held.
+static void font_load_glyph_metrics(RenFont* font, unsigned int codepoint) {
+  unsigned int load_option = font_set_load_options(font);
+  int bitmaps_cached = font->antialiasing == FONT_ANTIALIASING_SUBPIXEL ? SUBPIXEL_BITMAPS_CACHED : 1;
+  int idx = (codepoint / GLYPHSET_SIZE) % MAX_LOADABLE_GLYPHSETS;
+  GlyphMetric* metrics[SUBPIXEL_BITMAPS_CACHED];
+  for (int j = 0; j < bitmaps_cached; ++j)
+    metrics[j] = &font_alloc_glyphset(font, j, idx)->metrics[codepoint % GLYPHSET_SIZE];
+
+  // glyphs are read from the cache file when it has all their bitmaps, the
+  // others need their outline to rasterize those it doesn't have
+  const GlyphCacheRecord* record = font_cache_find(&font->cache, codepoint);
+  bool complete = record != NULL;
+  for (int j = 0; record && j < bitmaps_cached; ++j) {
+    if (record->bitmaps[j].offset == GLYPH_CACHE_NOT_SAVED)
+      complete = false;
+  }
+  if (complete) {
+    for (int j = 0; j < bitmaps_cached; ++j) {
+      metrics[j]->glyph_index = record->glyph_index;
+      metrics[j]->loaded = true;
+      metrics[j]->left = record->left;
+      metrics[j]->right = record->right;
+      metrics[j]->xadvance = record->xadvance;
+      metrics[j]->cached = &record->bitmaps[j];
+      if (record->bitmaps[j].width == 0 || record->bitmaps[j].rows == 0)
+        SDL_AtomicSet(&metrics[j]->resident, GLYPH_ATLAS_NONE);
+      SDL_AtomicSet(&metrics[j]->status, GLYPH_LOADED);
+    }
+    return;
+  }
+
+  FT_Glyph outline = NULL;
+  int glyph_index = FT_Get_Char_Index(font->face, codepoint);
+  if (!glyph_index || FT_Load_Glyph(font->face, glyph_index, load_option) || FT_Get_Glyph(font->face->glyph, &outline)) {
+    for (int j = 0; j < bitmaps_cached; ++j)
+      SDL_AtomicSet(&metrics[j]->status, GLYPH_MISSING);
+    return;
+  }
+  FT_GlyphSlot slot = font->face->glyph;
+  float xadvance = (slot->advance.x + slot->lsb_delta - slot->rsb_delta) / 64.0f;
+  // In order to fix issues with monospacing; we need the unhinted xadvance; as FreeType doesn't correctly report the hinted advance for spaces on monospace fonts (like RobotoMono). See #843.
+  FT_Fixed advance;
+  if (!FT_Get_Advance(font->face, glyph_index, (load_option | FT_LOAD_NO_HINTING) & ~FT_LOAD_FORCE_AUTOHINT, &advance))
+    xadvance = ((advance + 512) >> 10) / 64.0f;
+  int left, right;
+  bool blank = false;
+  if (slot->format == FT_GLYPH_FORMAT_OUTLINE) {
+    FT_BBox cbox;
+    font_set_style(&slot->outline, 0, font->style);
+    FT_Outline_Get_CBox(&slot->outline, &cbox);
+    left = (int) floor(cbox.xMin / 64.0) - 1;
+    right = (int) ceil(cbox.xMax / 64.0) + 2;
+    blank = slot->outline.n_points == 0;
+  } else {
+    left = slot->bitmap_left;
+    right = slot->bitmap_left + slot->bitmap.width;
+  }
+  for (int j = 0; j < bitmaps_cached; ++j) {
+    metrics[j]->glyph_index = glyph_index;
+    metrics[j]->loaded = true;
+    metrics[j]->left = left;
+    metrics[j]->right = right;
+    metrics[j]->xadvance = xadvance;
+    metrics[j]->outline = outline;
+    if (record && record->bitmaps[j].offset != GLYPH_CACHE_NOT_SAVED)
+      metrics[j]->cached = &record->bitmaps[j];
+    if (blank)
+      SDL_AtomicSet(&metrics[j]->resident, GLYPH_ATLAS_NONE);
+    SDL_AtomicSet(&metrics[j]->status, GLYPH_LOADED);
+  }
+  // tabs aren't saved, see font_cache_saves
+  if (codepoint != '\t')
+    font->cache.dirty = true;
+}
+
+// puts the bitmap of a glyph at its subpixel offset into the atlas, copying
+// it from the cache file or rendering it from the outline; otherwise marks
+// the glyph as having no bitmap, or as waiting for room. Called with
+// glyphset_mutex held
+static bool font_rasterize_glyph(RenFont* font, GlyphSet* set, GlyphMetric* metric) {
+  unsigned int byte_width = font->antialiasing == FONT_ANTIALIASING_SUBPIXEL ? 3 : 1;
+  const GlyphCacheBitmap* cached = metric->cached;
+  FT_BitmapGlyph glyph = NULL;
+  unsigned int width, rows;
+  if (cached) {
+    width = cached->width;
+    rows = cached->rows;
+  } else {
+    if (!(glyph = font_render_glyph(font, metric->outline, set->subpixel_idx))) {
+      SDL_AtomicSet(&metric->resident, GLYPH_ATLAS_NONE);
+      return false;
+    }
+    width = glyph->bitmap.width / byte_width;
+    rows = glyph->bitmap.rows;
+  }
+  int page_idx;
+  GlyphAtlasPage* page = NULL;
+  if (width > 0 && rows > 0)
+    page = glyph_atlas_alloc(width, rows, byte_width, &page_idx, &metric->atlas_x, &metric->atlas_y);
+  if (!page) {
+    if (glyph)
+      FT_Done_Glyph((FT_Glyph) glyph);
+    if (width > 0 && rows > 0 && width <= GLYPH_ATLAS_PAGE_SIZE && rows <= GLYPH_ATLAS_PAGE_SIZE) {
+      SDL_AtomicSet(&metric->resident, glyph_atlas_no_room());
+      SDL_AtomicSet(&glyph_atlas.starved, 1);
+    } else {
+      SDL_AtomicSet(&metric->resident, GLYPH_ATLAS_NONE);
+    }
+    return false;
+  }
+  metric->width = width;
+  metric->rows = rows;
+  SDL_AtomicSet(&page->last_used, glyph_atlas.frame);
+  const int pitch = GLYPH_ATLAS_PAGE_SIZE * byte_width;
+  uint8_t* target = &page->pixels[metric->atlas_y * pitch + metric->atlas_x * byte_width];
+  if (cached) {
+    metric->bitmap_left = cached->bitmap_left;
+    metric->bitmap_top = cached->bitmap_top;
+    const uint8_t* source = font->cache.file.data + cached->offset;
+    for (unsigned int line = 0; line < rows; ++line)
+      memcpy(&target[line * pitch], &source[line * width * byte_width], width * byte_width);
+  } else {
+    metric->bitmap_left = glyph->left;
+    metric->bitmap_top = glyph->top;
+    font_copy_bitmap(target, pitch, &glyph->bitmap);
+    FT_Done_Glyph((FT_Glyph) glyph);
+  }
+  // only publish the bitmap once it is complete, readers don't take the lock
+  SDL_AtomicSet(&metric->resident, glyph_atlas_resident(page_idx));
+  return true;
+}
+
+/******************* Glyph rasterizer **********************/
+
+// Bitmaps are rasterized by a background thread, so that text showing many
+// new glyphs at once doesn't stall the frame: the text is drawn without the
+// glyphs that aren't in the atlas yet, and the renderer cache draws it again
+// once the queue is empty. Metrics are still looked up right away, the layout
+// never waits on the rasterizer. The queue is guarded by glyphset_mutex, which
+// the thread holds while rasterizing a glyph. When there is nothing left to
+// rasterize, the thread also writes the glyph cache files, without the lock.
+typedef struct {
+  RenFont* font;
+  GlyphSet* set;
+  GlyphMetric* metric;
+} GlyphJob;
+
+typedef struct GlyphCacheWrite {
+  struct GlyphCacheWrite *next;
+  char *dir, *path;
+  uint8_t *data;
+  size_t size;
+} GlyphCacheWrite;
+
+static struct {
+  SDL_Thread *thread;
+  SDL_cond *cond;
+  GlyphJob *jobs;
+  int head, count, capacity;
+  GlyphCacheWrite *writes, *last_write;
+  bool quit;
+  // glyphs queued or being rasterized, and glyphs left out of drawn text
+  SDL_atomic_t pending, deferred;
+} rasterizer;
+
+static void glyph_cache_write(GlyphCacheWrite* write) {
+  make_dir(write->dir);
+  write_file_replace(write->path, write->data, write->size);
+  free(write->dir);
+  free(write->path);
+  free(write->data);
+  free(write);
+}
+
+// called with glyphset_mutex held
+static GlyphCacheWrite* glyph_rasterizer_pop_write(void) {
+  GlyphCacheWrite* write = rasterizer.writes;
+  if (write && !(rasterizer.writes = write->next))
+    rasterizer.last_write = NULL;
+  return write;
+}
+
+static int glyph_rasterizer_main(UNUSED void *data) {
+  SDL_LockMutex(glyphset_mutex);
+  while (!rasterizer.quit) {
+    if (rasterizer.count == 0) {
+      GlyphCacheWrite* write = glyph_rasterizer_pop_write();
+      if (write) {
+        SDL_UnlockMutex(glyphset_mutex);
+        glyph_cache_write(write);
+        SDL_LockMutex(glyphset_mutex);
+      } else {
+        SDL_CondWait(rasterizer.cond, glyphset_mutex);
       }
+      continue;
     }
+    GlyphJob job = rasterizer.jobs[rasterizer.head++];
+    if (--rasterizer.count == 0)
+      rasterizer.head = 0;
+    font_rasterize_glyph(job.font, job.set, job.metric);
+    job.metric->queued = false;
+    SDL_AtomicAdd(&rasterizer.pending, -1);
+    // let the render threads look up metrics between glyphs
+    SDL_UnlockMutex(glyphset_mutex);
+    SDL_LockMutex(glyphset_mutex);
   }
+  SDL_UnlockMutex(glyphset_mutex);
+  return 0;
 }
 
+static void glyph_rasterizer_init(void) {
+  rasterizer.cond = SDL_CreateCond();
+  if (rasterizer.cond)
+    rasterizer.thread = SDL_CreateThread(glyph_rasterizer_main, "glyphs", NULL);
+  if (!rasterizer.thread)
+    fprintf(stderr, "Warning: (" __FILE__ "): unable to start the glyph rasterizer, rasterizing on the render threads\n");
+}
+
+static void glyph_rasterizer_free(void) {
+  if (rasterizer.thread) {
+    SDL_LockMutex(glyphset_mutex);
+    rasterizer.quit = true;
+    SDL_CondSignal(rasterizer.cond);
+    SDL_UnlockMutex(glyphset_mutex);
+    SDL_WaitThread(rasterizer.thread, NULL);
+  }
+  // the files the thread didn't get to are written now
+  for (GlyphCacheWrite* write; (write = glyph_rasterizer_pop_write());)
+    glyph_cache_write(write);
+  if (rasterizer.cond)
+    SDL_DestroyCond(rasterizer.cond);
+  free(rasterizer.jobs);
+  memset(&rasterizer, 0, sizeof(rasterizer));
+}
+
+// called with glyphset_mutex held
+static void glyph_rasterizer_push(RenFont* font, GlyphSet* set, GlyphMetric* metric) {
+  if (metric->queued || glyph_atlas_is_resident(SDL_AtomicGet(&metric->resident)))
+    return;
+  if (rasterizer.head + rasterizer.count == rasterizer.capacity) {
+    if (rasterizer.head > 0) {
+      memmove(rasterizer.jobs, rasterizer.jobs + rasterizer.head, rasterizer.count * sizeof(GlyphJob));
+      rasterizer.head = 0;
+    } else {
+      rasterizer.capacity = rasterizer.capacity ? rasterizer.capacity * 2 : GLYPH_QUEUE_INIT_SIZE;
+      rasterizer.jobs = check_alloc(realloc(rasterizer.jobs, rasterizer.capacity * sizeof(GlyphJob)));
+    }
+  }
+  rasterizer.jobs[rasterizer.head + rasterizer.count++] = (GlyphJob){ font, set, metric };
+  metric->queued = true;
+  SDL_AtomicAdd(&rasterizer.pending, 1);
+  SDL_CondSignal(rasterizer.cond);
+}
+
+// drops the queued glyphs of a font before its glyphsets are freed or put
+// aside, those that are kept get queued again when drawn
+static void glyph_rasterizer_cancel(RenFont* font) {
+  if (!glyphset_mutex)
+    return;
+  SDL_LockMutex(glyphset_mutex);
+  int kept = 0;
+  for (int i = rasterizer.head; i < rasterizer.head + rasterizer.count; ++i) {
+    if (rasterizer.jobs[i].font != font)
+      rasterizer.jobs[rasterizer.head + kept++] = rasterizer.jobs[i];
+    else
+      rasterizer.jobs[i].metric->queued = false;
+  }
+  SDL_AtomicAdd(&rasterizer.pending, kept - rasterizer.count);
+  rasterizer.count = kept;
+  SDL_UnlockMutex(glyphset_mutex);
+}
+
+int ren_get_pending_glyphs(void) {
+  return SDL_AtomicGet(&rasterizer.pending);
+}
+
+int ren_take_deferred_glyphs(void) {
+  return SDL_AtomicSet(&rasterizer.deferred, 0);
+}
+
+
 static GlyphSet* font_get_glyphset(RenFont* font, unsigned int codepoint, int subpixel_idx) {
   int idx = (codepoint / GLYPHSET_SIZE) % MAX_LOADABLE_GLYPHSETS;
-  if (!font->sets[font->antialiasing == FONT_ANTIALIASING_SUBPIXEL ? subpixel_idx : 0][idx])
-    font_load_glyphset(font, idx);
-  return font->sets[font->antialiasing == FONT_ANTIALIASING_SUBPIXEL ? subpixel_idx : 0][idx];
+  if (font->antialiasing != FONT_ANTIALIASING_SUBPIXEL)
+    subpixel_idx = 0;
+  GlyphSet* set = SDL_AtomicGetPtr((void**)&font->sets[subpixel_idx][idx]);
+  if (!set) {
+    SDL_LockMutex(glyphset_mutex);
+    set = font_alloc_glyphset(font, subpixel_idx, idx);
+    SDL_UnlockMutex(glyphset_mutex);
+  }
+  return set;
+}
+
+static GlyphMetric* font_get_glyph_metric(RenFont* font, GlyphSet* set, unsigned int codepoint) {
+  GlyphMetric* metric = &set->metrics[codepoint % GLYPHSET_SIZE];
+  if (SDL_AtomicGet(&metric->status) == GLYPH_UNKNOWN) {
+    SDL_LockMutex(glyphset_mutex);
+    if (SDL_AtomicGet(&metric->status) == GLYPH_UNKNOWN)
+      font_load_glyph_metrics(font, codepoint);
+    SDL_UnlockMutex(glyphset_mutex);
+  }
+  return metric;
+}
+
+// returns the bitmap of a glyph in the atlas; when it isn't there yet, it is
+// copied right away from the cache file if it is in there, otherwise it is
+// queued to be rasterized and left out of the text for now. Glyphs that found
+// no room are left out until pages were evicted at the end of the frame, the
+// text is drawn again after that.
+static const uint8_t* font_get_glyph_bitmap(RenFont* font, GlyphSet* set, GlyphMetric* metric, int *pitch) {
+  if (!metric->loaded)
+    return NULL;
+  int resident = SDL_AtomicGet(&metric->resident);
+  if (!glyph_atlas_is_resident(resident)) {
+    if (resident == GLYPH_ATLAS_NONE)
+      return NULL;
+    if (resident == glyph_atlas_no_room()) {
+      SDL_AtomicSet(&glyph_atlas.starved, 1);
+      SDL_AtomicAdd(&rasterizer.deferred, 1);
+      return NULL;
+    }
+    SDL_LockMutex(glyphset_mutex);
+    bool queue = rasterizer.thread && (!metric->cached || metric->queued);
+    if (queue) {
+      glyph_rasterizer_push(font, set, metric);
+      SDL_AtomicAdd(&rasterizer.deferred, 1);
+    } else if (!glyph_atlas_is_resident(SDL_AtomicGet(&metric->resident))) {
+      font_rasterize_glyph(font, set, metric);
+    }
+    resident = SDL_AtomicGet(&metric->resident);
+    SDL_UnlockMutex(glyphset_mutex);
+    if (!queue && resident == glyph_atlas_no_room())
+      SDL_AtomicAdd(&rasterizer.deferred, 1);
+    if (queue || !glyph_atlas_is_resident(resident))
+      return NULL;
+  }
+  GlyphAtlasPage* page = &glyph_atlas.pages[(resident - 1) % GLYPH_ATLAS_MAX_PAGES];
+  if (SDL_AtomicGet(&page->last_used) != glyph_atlas.frame)
+    SDL_AtomicSet(&page->last_used, glyph_atlas.frame);
+  *pitch = GLYPH_ATLAS_PAGE_SIZE * page->bytes_per_pixel;
+  return &page->pixels[metric->atlas_y * *pitch + metric->atlas_x * page->bytes_per_pixel];
 }
 
 static RenFont* font_group_get_glyph(GlyphSet** set, GlyphMetric** metric, RenFont** fonts, unsigned int codepoint, int bitmap_index) {
@@ -191,7 +1318,7 @@ static RenFont* font_group_get_glyph(GlyphSet** set, GlyphMetric** metric, RenFo
     bitmap_index += SUBPIXEL_BITMAPS_CACHED;
   for (int i = 0; i < FONT_FALLBACK_MAX && fonts[i]; ++i) {
     *set = font_get_glyphset(fonts[i], codepoint, bitmap_index);
-    *metric = &(*set)->metrics[codepoint % GLYPHSET_SIZE];
+    *metric = font_get_glyph_metric(fonts[i], *set, codepoint);
     if ((*metric)->loaded || codepoint < 0xFF)
       return fonts[i];
   }
@@ -200,17 +1327,92 @@ static RenFont* font_group_get_glyph(GlyphSet** set, GlyphMetric** metric, RenFo
   return fonts[0];
 }
 
-static void font_clear_glyph_cache(RenFont* font) {
+// saves the cache file of a size of the font if it loaded glyphs that weren't
+// in it, and unmaps it; nothing may be drawing with these glyphs anymore. The
+// file is written by the rasterizer thread, or right away without it.
+static void font_cache_close(RenFont* font, GlyphSet* (*sets)[MAX_LOADABLE_GLYPHSETS], GlyphCache* cache) {
+  GlyphCacheWrite* write = NULL;
+  if (cache->dirty && cache->path && glyph_cache_dir && glyphset_mutex) {
+    write = check_alloc(calloc(1, sizeof(GlyphCacheWrite)));
+    write->dir = check_alloc(malloc(strlen(glyph_cache_dir) + 1));
+    strcpy(write->dir, glyph_cache_dir);
+    write->path = cache->path;
+    cache->path = NULL;
+    SDL_LockMutex(glyphset_mutex);
+    write->data = font_cache_serialize(font, sets, cache, &write->size);
+    if (rasterizer.thread) {
+      if (rasterizer.last_write)
+        rasterizer.last_write->next = write;
+      else
+        rasterizer.writes = write;
+      rasterizer.last_write = write;
+      SDL_CondSignal(rasterizer.cond);
+      write = NULL;
+    }
+    SDL_UnlockMutex(glyphset_mutex);
+  }
+  mapped_file_close(&cache->file);
+  if (write)
+    glyph_cache_write(write);
+  free(cache->path);
+  free(cache->key);
+  memset(cache, 0, sizeof(GlyphCache));
+}
+
+// frees the glyphs of a size of the font, they are saved to its cache file
+// first; the bitmaps are left in the atlas, they go away with their page. The
+// rasterizer must be done with the font.
+static void font_free_glyphs(RenFont* font, GlyphSet* (*sets)[MAX_LOADABLE_GLYPHSETS], GlyphCache* cache) {
+  font_cache_close(font, sets, cache);
   for (int i = 0; i < SUBPIXEL_BITMAPS_CACHED; ++i) {
     for (int j = 0; j < MAX_LOADABLE_GLYPHSETS; ++j) {
-      if (font->sets[i][j]) {
-        if (font->sets[i][j]->surface)
-          SDL_FreeSurface(font->sets[i][j]->surface);
-        free(font->sets[i][j]);
-        font->sets[i][j] = NULL;
+      if (sets[i][j]) {
+        for (int k = 0; i == 0 && k < GLYPHSET_SIZE; ++k) {
+          if (sets[i][j]->metrics[k].outline)
+            FT_Done_Glyph(sets[i][j]->metrics[k].outline);
+        }
+        free(sets[i][j]);
       }
     }
   }
+  free(sets);
+}
+
+// Font files are mapped once and shared by all the fonts loaded from the same
+// path, like copies at other sizes or styles. Only the main thread loads and
+// frees fonts, so the list isn't locked.
+static FontFile* font_files;
+
+static FontFile* font_file_acquire(const char* path) {
+  for (FontFile* file = font_files; file; file = file->next) {
+    if (strcmp(file->path, path) == 0) {
+      file->refs++;
+      return file;
+    }
+  }
+  FontFile* file = check_alloc(calloc(1, sizeof(FontFile) + strlen(path) + 1));
+  if (!mapped_file_open(&file->file, path)) {
+    free(file);
+    return NULL;
+  }
+  strcpy(file->path, path);
+  file->refs = 1;
+  file->next = font_files;
+  font_files = file;
+  return file;
+}
+
+static void font_file_release(FontFile* file) {
+  if (!file || --file->refs > 0)
+    return;
+  for (FontFile** link = &font_files; *link; link = &(*link)->next) {
+    if (*link == file) {
+      *link = file->next;
+      break;
+    }
+  }
+  mapped_file_close(&file->file);
+  free(file);
 }
 
 // based on https://github.com/libsdl-org/SDL_ttf/blob/2a094959055fba09f7deed6e1ffeb986188982ae/SDL_ttf.c#L1735
@@ -233,60 +1435,159 @@ static void font_file_close(FT_Stream stream) {
   }
 }
 
+// A face is only taken as monospace if it says so and all its printable ASCII
+// glyphs have the same advance, as measured for layout, so that the width of
+// ASCII text can be computed from its length.
+static void font_check_monospace(RenFont* font) {
+  font->monospace_advance = 0;
+  if (!FT_IS_FIXED_WIDTH(font->face))
+    return;
+  float advance = 0;
+  for (unsigned int codepoint = 0x20; codepoint < 0x7F; ++codepoint) {
+    GlyphMetric* metric = font_get_glyph_metric(font, font_get_glyphset(font, codepoint, 0), codepoint);
+    if (!metric->loaded || !metric->xadvance || (advance && metric->xadvance != advance))
+      return;
+    advance = metric->xadvance;
+  }
+  font->monospace_advance = advance;
+}
+
+// loads the glyphs of the font at its pixel size from scratch, once the
+// FreeType size for it is active; false if the face can't be used at it
+static bool font_init_size(RenFont* font) {
+  font->sets = check_alloc(calloc(SUBPIXEL_BITMAPS_CACHED, sizeof(*font->sets)));
+  if (FT_Set_Pixel_Sizes(font->face, 0, font->pixel_size) || FT_Load_Char(font->face, ' ', font_set_load_options(font)))
+    return false;
+  font->space_advance = font->face->glyph->advance.x / 64.0f;
+  font_cache_open(font);
+  font_check_monospace(font);
+  return true;
+}
+
+// Switches the font to another pixel size. The glyphs of the current one are
+// put aside with its FreeType size, and made current again if the font goes
+// back to it; past FONT_SIZES_KEPT, the least recently used size is freed.
+// If the face can't be used at the new size, the font stays at the current
+// one and false is returned.
+static bool font_set_pixel_size(RenFont* font, int pixel_size) {
+  static unsigned int clock;
+  if (pixel_size == font->pixel_size)
+    return true;
+  glyph_rasterizer_cancel(font);
+  FontSize current = { font->face->size, font->pixel_size, font->sets, font->cache,
+    font->space_advance, font->monospace_advance, ++clock };
+  for (int i = 0; i < FONT_SIZES_KEPT; ++i) {
+    FontSize* kept = &font->sizes[i];
+    if (kept->ft_size && kept->pixel_size == pixel_size) {
+      FT_Activate_Size(kept->ft_size);
+      font->pixel_size = pixel_size;
+      font->sets = kept->sets;
+      font->cache = kept->cache;
+      font->space_advance = kept->space_advance;
+      font->monospace_advance = kept->monospace_advance;
+      *kept = current;
+      return true;
+    }
+  }
+  FT_Size ft_size = NULL;
+  if (pixel_size == font->unusable_pixel_size || FT_New_Size(font->face, &ft_size))
+    return false;
+  FT_Activate_Size(ft_size);
+  font->pixel_size = pixel_size;
+  memset(&font->cache, 0, sizeof(GlyphCache));
+  if (!font_init_size(font)) {
+    font_free_glyphs(font, font->sets, &font->cache);
+    FT_Done_Size(ft_size);
+    FT_Activate_Size(current.ft_size);
+    font->pixel_size = current.pixel_size;
+    font->sets = current.sets;
+    font->cache = current.cache;
+    font->space_advance = current.space_advance;
+    font->monospace_advance = current.monospace_advance;
+    font->unusable_pixel_size = pixel_size;
+    return false;
+  }
+  FontSize* slot = &font->sizes[0];
+  for (int i = 1; i < FONT_SIZES_KEPT && slot->ft_size; ++i) {
+    if (!font->sizes[i].ft_size || font->sizes[i].last_used < slot->last_used)
+      slot = &font->sizes[i];
+  }
+  if (slot->ft_size) {
+    font_free_glyphs(font, slot->sets, &slot->cache);
+    FT_Done_Size(slot->ft_size);
+  }
+  *slot = current;
+  return true;
+}
+
+// The widths of the strings measured recently, as the same tokens are measured
+// again every frame to lay them out. Entries are found by a hash of the fonts
+// and the text, and are only valid for the generation they were measured in,
+// which changes whenever the advances of a font could have changed. Only
+// used from the main thread.
+typedef struct {
+  uint64_t key;
+  unsigned generation;
+  double width;
+  int x_offset;
+} TextWidth;
+
+static struct {
+  TextWidth entries[TEXT_WIDTH_CACHE_SIZE];
+  unsigned generation;
+} text_widths = { .generation = 1 };
+
 RenFont* ren_font_load(RenWindow *window_renderer, const char* path, float size, ERenFontAntialiasing antialiasing, ERenFontHinting hinting, unsigned char style) {
   RenFont *font = NULL;
   FT_Face face = NULL;
-  
-  SDL_RWops *file = SDL_RWFromFile(path, "rb");
-  if (!file)
-    goto rwops_failure;
 
   int len = strlen(path);
   font = check_alloc(calloc(1, sizeof(RenFont) + len + 1));
-  font->stream.read = font_file_read;
-  font->stream.close = font_file_close;
-  font->stream.descriptor.pointer = file;
-  font->stream.pos = 0;
-  font->stream.size = (unsigned long) SDL_RWsize(file);
-
-  if (FT_Open_Face(library, &(FT_Open_Args){ .flags = FT_OPEN_STREAM, .stream = &font->stream }, 0, &face))
-    goto failure;
-
-  const int surface_scale = renwin_get_surface(window_renderer).scale;
-  if (FT_Set_Pixel_Sizes(face, 0, (int)(size*surface_scale)))
-    goto failure;
+  font->file = font_file_acquire(path);
+  if (font->file) {
+    if (FT_New_Memory_Face(library, font->file->file.data, (FT_Long) font->file->file.size, 0, &face))
+      goto failure;
+  } else {
+    SDL_RWops *file = SDL_RWFromFile(path, "rb");
+    if (!file)
+      goto failure;
+    font->stream.read = font_file_read;
+    font->stream.close = font_file_close;
+    font->stream.descriptor.pointer = file;
+    font->stream.pos = 0;
+    font->stream.size = (unsigned long) SDL_RWsize(file);
+
+    if (FT_Open_Face(library, &(FT_Open_Args){ .flags = FT_OPEN_STREAM, .stream = &font->stream }, 0, &face))
+      goto failure;
+  }
 
   strcpy(font->path, path);
   font->face = face;
   font->size = size;
+  font->pixel_size = (int)(size * renwin_get_surface(window_renderer).scale);
   font->height = (short)((face->height / (float)face->units_per_EM) * font->size);
   font->baseline = (short)((face->ascender / (float)face->units_per_EM) * font->size);
   font->antialiasing = antialiasing;
   font->hinting = hinting;
   font->style = style;
+  if (!font_init_size(font))
+    goto failure;
 
   if(FT_IS_SCALABLE(face))
     font->underline_thickness = (unsigned short)((face->underline_thickness / (float)face->units_per_EM) * font->size);
   if(!font->underline_thickness)
     font->underline_thickness = ceil((double) font->height / 14.0);
 
-  if (FT_Load_Char(face, ' ', font_set_load_options(font)))
-    goto failure;
-
-  font->space_advance = face->glyph->advance.x / 64.0f;
   font->tab_advance = font->space_advance * 2;
+  font_count++;
   return font;
 
 failure:
   if (face)
     FT_Done_Face(face);
-  if (font)
-    free(font);
-  return NULL;
-
-rwops_failure:
-  if (file)
-    SDL_RWclose(file);
+  font_file_release(font->file);
+  free(font->sets);
+  free(font);
   return NULL;
 }
 
@@ -302,23 +1603,45 @@ const char* ren_font_get_path(RenFont *font) {
   return font->path;
 }
 
+// frees what the glyphs of all the fonts share
+static void ren_free_glyphs(void) {
+  glyph_rasterizer_free();
+  glyph_atlas_free();
+  SDL_DestroyMutex(glyphset_mutex);
+  glyphset_mutex = NULL;
+}
+
 void ren_font_free(RenFont* font) {
-  font_clear_glyph_cache(font);
+  // another font could be allocated at the same address
+  text_widths.generation++;
+  glyph_rasterizer_cancel(font);
+  font_free_glyphs(font, font->sets, &font->cache);
+  for (int i = 0; i < FONT_SIZES_KEPT; ++i) {
+    if (font->sizes[i].ft_size)
+      font_free_glyphs(font, font->sizes[i].sets, &font->sizes[i].cache);
+  }
   FT_Done_Face(font->face);
+  font_file_release(font->file);
   free(font);
+  if (--font_count == 0 && renderer_freed)
+    ren_free_glyphs();
 }
 
 void ren_font_group_set_tab_size(RenFont **fonts, int n) {
-  unsigned int tab_index = '\t' % GLYPHSET_SIZE;
   for (int j = 0; j < FONT_FALLBACK_MAX && fonts[j]; ++j) {
-    for (int i = 0; i < (fonts[j]->antialiasing == FONT_ANTIALIASING_SUBPIXEL ? SUBPIXEL_BITMAPS_CACHED : 1); ++i)
-      font_get_glyphset(fonts[j], '\t', i)->metrics[tab_index].xadvance = fonts[j]->space_advance * n;
+    for (int i = 0; i < (fonts[j]->antialiasing == FONT_ANTIALIASING_SUBPIXEL ? SUBPIXEL_BITMAPS_CACHED : 1); ++i) {
+      GlyphMetric* metric = font_get_glyph_metric(fonts[j], font_get_glyphset(fonts[j], '\t', i), '\t');
+      // this is called before every layout, only changes invalidate the widths
+      if (metric->xadvance != fonts[j]->space_advance * n) {
+        metric->xadvance = fonts[j]->space_advance * n;
+        text_widths.generation++;
+      }
+    }
   }
 }
 
 int ren_font_group_get_tab_size(RenFont **fonts) {
-  unsigned int tab_index = '\t' % GLYPHSET_SIZE;
-  float advance = font_get_glyphset(fonts[0], '\t', 0)->metrics[tab_index].xadvance;
+  float advance = font_get_glyph_metric(fonts[0], font_get_glyphset(fonts[0], '\t', 0), '\t')->xadvance;
   if (fonts[0]->space_advance) {
     advance /= fonts[0]->space_advance;
   }
@@ -330,16 +1653,14 @@ float ren_font_group_get_size(RenFont **fonts) {
 }
 
 void ren_font_group_set_size(RenWindow *window_renderer, RenFont **fonts, float size) {
-  const int surface_scale = renwin_get_surface(window_renderer).scale;
+  const float surface_scale = renwin_get_surface(window_renderer).scale;
+  text_widths.generation++;
   for (int i = 0; i < FONT_FALLBACK_MAX && fonts[i]; ++i) {
-    font_clear_glyph_cache(fonts[i]);
     FT_Face face = fonts[i]->face;
-    FT_Set_Pixel_Sizes(face, 0, (int)(size*surface_scale));
+    font_set_pixel_size(fonts[i], (int)(size * surface_scale));
     fonts[i]->size = size;
     fonts[i]->height = (short)((face->height / (float)face->units_per_EM) * size);
     fonts[i]->baseline = (short)((face->ascender / (float)face->units_per_EM) * size);
-    FT_Load_Char(face, ' ', font_set_load_options(fonts[i]));
-    fonts[i]->space_advance = face->glyph->advance.x / 64.0f;
     fonts[i]->tab_advance = fonts[i]->space_advance * 2;
   }
 }
@@ -348,64 +1669,125 @@ int ren_font_group_get_height(RenFont **fonts) {
   return fonts[0]->height;
 }
 
-double ren_font_group_get_width(RenWindow *window_renderer, RenFont **fonts, const char *text, size_t len, int *x_offset) {
-  double width = 0;
-  const char* end = text + len;
-  GlyphMetric* metric = NULL; GlyphSet* set = NULL;
-  bool set_x_offset = x_offset == NULL;
-  while (text < end) {
-    unsigned int codepoint;
-    text = utf8_to_codepoint(text, &codepoint);
-    RenFont* font = font_group_get_glyph(&set, &metric, fonts, codepoint, 0);
-    if (!metric)
-      break;
-    width += (!font || metric->xadvance) ? metric->xadvance : fonts[0]->space_advance;
-    if (!set_x_offset) {
-      set_x_offset = true;
-      *x_offset = metric->bitmap_left; // TODO: should this be scaled by the surface scale?
+bool ren_font_group_is_monospace(RenFont **fonts) {
+  return fonts[0]->monospace_advance > 0;
+}
+
+// The width of text made of printable ASCII characters and tabs, when the
+// first font is monospace; all of these come from the first font, as it has
+// them. Other text returns false.
+static bool font_group_get_ascii_width(RenFont **fonts, const char *text, size_t len, double *width, int *x_offset) {
+  RenFont* font = fonts[0];
+  size_t tabs = 0;
+  if (!font->monospace_advance)
+    return false;
+  for (size_t i = 0; i < len; ++i) {
+    unsigned char c = text[i];
+    if (c == '\t')
+      tabs++;
+    else if (c < 0x20 || c >= 0x7F)
+      return false;
+  }
+  *width = (len - tabs) * (double) font->monospace_advance;
+  if (tabs > 0) {
+    GlyphMetric* tab = font_get_glyph_metric(font, font_get_glyphset(font, '\t', 0), '\t');
+    *width += tabs * (double) (tab->xadvance ? tab->xadvance : font->space_advance);
+  }
+  *x_offset = len > 0 ? font_get_glyph_metric(font, font_get_glyphset(font, text[0], 0), text[0])->left : 0;
+  return true;
+}
+
+// The scale of the surface changes when the window moves to a monitor with
+// another one; fonts switch to the pixel size it needs the next time they are
+// measured, which is before anything is drawn with them.
+static void font_group_follow_scale(RenFont **fonts, float surface_scale) {
+  for (int i = 0; i < FONT_FALLBACK_MAX && fonts[i]; ++i) {
+    int pixel_size = (int)(fonts[i]->size * surface_scale);
+    if (fonts[i]->pixel_size != pixel_size && font_set_pixel_size(fonts[i], pixel_size)) {
+      fonts[i]->tab_advance = fonts[i]->space_advance * 2;
+      text_widths.generation++;
     }
   }
-  const int surface_scale = renwin_get_surface(window_renderer).scale;
-  if (!set_x_offset) {
-    *x_offset = 0;
+}
+
+double ren_font_group_get_width(RenWindow *window_renderer, RenFont **fonts, const char *text, size_t len, int *x_offset) {
+  const float surface_scale = renwin_get_surface(window_renderer).scale;
+  font_group_follow_scale(fonts, surface_scale);
+  double width;
+  int left;
+  if (font_group_get_ascii_width(fonts, text, len, &width, &left)) {
+    if (x_offset)
+      *x_offset = left; // TODO: should this be scaled by the surface scale?
+    return width / surface_scale;
+  }
+  uint64_t key = hash_bytes(hash_bytes(HASH_INITIAL, fonts, sizeof(RenFont*) * FONT_FALLBACK_MAX), text, len);
+  TextWidth* entry = &text_widths.entries[(key >> 32) & (TEXT_WIDTH_CACHE_SIZE - 1)];
+  if (entry->key != key || entry->generation != text_widths.generation) {
+    width = 0;
+    left = 0;
+    const char* end = text + len;
+    GlyphMetric* metric = NULL; GlyphSet* set = NULL;
+    for (const char* p = text; p < end; ) {
+      unsigned int codepoint;
+      bool first = p == text;
+      p = utf8_to_codepoint(p, &codepoint);
+      RenFont* font = font_group_get_glyph(&set, &metric, fonts, codepoint, 0);
+      if (!metric)
+        break;
+      width += (!font || metric->xadvance) ? metric->xadvance : fonts[0]->space_advance;
+      if (first)
+        left = metric->left;
+    }
+    *entry = (TextWidth) { key, text_widths.generation, width, left };
   }
-  return width / surface_scale;
+  if (x_offset)
+    *x_offset = entry->x_offset; // TODO: should this be scaled by the surface scale?
+  return entry->width / surface_scale;
 }
 
-double ren_draw_text(RenSurface *rs, RenFont **fonts, const char *text, size_t len, float x, int y, RenColor color) {
+double ren_draw_text(RenSurface *rs, RenFont **fonts, const char *text, size_t len, float x, int y, RenColor color, int tab_size) {
   SDL_Surface *surface = rs->surface;
   SDL_Rect clip;
   SDL_GetClipRect(surface, &clip);
 
-  const int surface_scale = rs->scale;
+  const float surface_scale = rs->scale;
   double pen_x = x * surface_scale;
-  y *= surface_scale;
+  const int pixel_y = scale_coordinate(y, surface_scale);
+  const int baseline = scale_coordinate(fonts[0]->baseline, surface_scale);
   int bytes_per_pixel = surface->format->BytesPerPixel;
   const char* end = text + len;
   uint8_t* destination_pixels = surface->pixels;
   int clip_end_x = clip.x + clip.w, clip_end_y = clip.y + clip.h;
+  const SDL_PixelFormat *format = surface->format;
+  const PixelOps *ops = get_pixel_ops(format);
+  const uint32_t color_word = ops->pack(color, format);
+  uint32_t coverage[BLEND_CHUNK];
 
   RenFont* last = NULL;
-  double last_pen_x = x;
+  double last_pen_x = pen_x;
   bool underline = fonts[0]->style & FONT_STYLE_UNDERLINE;
   bool strikethrough = fonts[0]->style & FONT_STYLE_STRIKETHROUGH;
 
   while (text < end) {
-    unsigned int codepoint, r, g, b;
+    unsigned int codepoint;
     text = utf8_to_codepoint(text, &codepoint);
     GlyphSet* set = NULL; GlyphMetric* metric = NULL;
     RenFont* font = font_group_get_glyph(&set, &metric, fonts, codepoint, (int)(fmod(pen_x, 1.0) * SUBPIXEL_BITMAPS_CACHED));
     if (!metric)
       break;
-    int start_x = floor(pen_x) + metric->bitmap_left;
-    int end_x = (metric->x1 - metric->x0) + start_x;
-    int glyph_end = metric->x1, glyph_start = metric->x0;
+    const int pen = floor(pen_x);
+    const uint8_t* source_pixels = NULL;
+    int source_pitch = 0;
     if (!metric->loaded && codepoint > 0xFF)
-      ren_draw_rect(rs, (RenRect){ start_x + 1, y, font->space_advance - 1, ren_font_group_get_height(fonts) }, color);
-    if (set->surface && color.a > 0 && end_x >= clip.x && start_x < clip_end_x) {
-      uint8_t* source_pixels = set->surface->pixels;
-      for (int line = metric->y0; line < metric->y1; ++line) {
-        int target_y = line + y - metric->bitmap_top + fonts[0]->baseline * surface_scale;
+      ren_draw_rect(rs, (RenRect){ pen / surface_scale + 1, y, font->space_advance / surface_scale - 1, ren_font_group_get_height(fonts) }, color);
+    if (color.a > 0 && pen + metric->right >= clip.x && pen + metric->left < clip_end_x)
+      source_pixels = font_get_glyph_bitmap(font, set, metric, &source_pitch);
+    if (source_pixels) {
+      // the bitmap metrics are only known once the glyph is resident
+      int start_x = pen + metric->bitmap_left;
+      int glyph_end = metric->width, glyph_start = 0;
+      for (int line = 0; line < metric->rows; ++line) {
+        int target_y = line + pixel_y - metric->bitmap_top + baseline;
         if (target_y < clip.y)
           continue;
         if (target_y >= clip_end_y)
@@ -418,43 +1800,35 @@ double ren_draw_text(RenSurface *rs, RenFont **fonts, const char *text, size_t l
           glyph_start += offset;
         }
         uint32_t* destination_pixel = (uint32_t*)&(destination_pixels[surface->pitch * target_y + start_x * bytes_per_pixel]);
-        uint8_t* source_pixel = &source_pixels[line * set->surface->pitch + glyph_start * (font->antialiasing == FONT_ANTIALIASING_SUBPIXEL ? 3 : 1)];
-        for (int x = glyph_start; x < glyph_end; ++x) {
-          uint32_t destination_color = *destination_pixel;
-          // the standard way of doing this would be SDL_GetRGBA, but that introduces a performance regression. needs to be investigated
-          SDL_Color dst = { (destination_color & surface->format->Rmask) >> surface->format->Rshift, (destination_color & surface->format->Gmask) >> surface->format->Gshift, (destination_color & surface->format->Bmask) >> surface->format->Bshift, (destination_color & surface->format->Amask) >> surface->format->Ashift };
-          SDL_Color src;
-
+        const uint8_t* source_pixel = &source_pixels[line * source_pitch + glyph_start * (font->antialiasing == FONT_ANTIALIASING_SUBPIXEL ? 3 : 1)];
+        for (int x = glyph_start; x < glyph_end; x += BLEND_CHUNK) {
+          int count = glyph_end - x < BLEND_CHUNK ? glyph_end - x : BLEND_CHUNK;
           if (font->antialiasing == FONT_ANTIALIASING_SUBPIXEL) {
-            src.r = *(source_pixel++);
-            src.g = *(source_pixel++);
+            ops->expand_subpixel(coverage, source_pixel, count, color.a, format);
+            source_pixel += count * 3;
+          } else {
+            ops->expand_gray(coverage, source_pixel, count, color.a, format);
+            source_pixel += count;
           }
-          else  {
-            src.r = *(source_pixel);
-            src.g = *(source_pixel);
-          }
-
-          src.b = *(source_pixel++);
-          src.a = 0xFF;
-
-          r = (color.r * src.r * color.a + dst.r * (65025 - src.r * color.a) + 32767) / 65025;
-          g = (color.g * src.g * color.a + dst.g * (65025 - src.g * color.a) + 32767) / 65025;
-          b = (color.b * src.b * color.a + dst.b * (65025 - src.b * color.a) + 32767) / 65025;
-          // the standard way of doing this would be SDL_GetRGBA, but that introduces a performance regression. needs to be investigated
-          *destination_pixel++ = dst.a << surface->format->Ashift | r << surface->format->Rshift | g << surface->format->Gshift | b << surface->format->Bshift;
+          blend_row(destination_pixel, coverage, count, color_word);
+          destination_pixel += count;
         }
       }
     }
 
-    float adv = metric->xadvance ? metric->xadvance : font->space_advance;
+    // the tab size is passed in rather than read back from the glyph metrics,
+    // so that commands with different tab sizes can be drawn concurrently
+    float adv = codepoint == '\t' ? fonts[0]->space_advance * tab_size : metric->xadvance;
+    if (!adv)
+      adv = font->space_advance;
 
     if(!last) last = font;
     else if(font != last || text == end) {
       double local_pen_x = text == end ? pen_x + adv : pen_x;
       if (underline)
-        ren_draw_rect(rs, (RenRect){last_pen_x, y / surface_scale + last->height - 1, (local_pen_x - last_pen_x) / surface_scale, last->underline_thickness * surface_scale}, color);
+        ren_draw_rect(rs, (RenRect){last_pen_x / surface_scale, y + last->height - 1, (local_pen_x - last_pen_x) / surface_scale, last->underline_thickness}, color);
       if (strikethrough)
-        ren_draw_rect(rs, (RenRect){last_pen_x, y / surface_scale + last->height / 2, (local_pen_x - last_pen_x) / surface_scale, last->underline_thickness * surface_scale}, color);
+        ren_draw_rect(rs, (RenRect){last_pen_x / surface_scale, y + last->height / 2, (local_pen_x - last_pen_x) / surface_scale, last->underline_thickness}, color);
       last = font;
       last_pen_x = pen_x;
     }
@@ -465,6 +1839,14 @@ double ren_draw_text(RenSurface *rs, RenFont **fonts, const char *text, size_t l
 }
 
 /******************* Rectangles **********************/
+// rects are scaled by their edges, so that rects sharing an edge in points
+// share it in pixels at fractional scales too
+RenRect ren_scale_rect(RenRect rect, float scale) {
+  int x1 = scale_coordinate(rect.x, scale), y1 = scale_coordinate(rect.y, scale);
+  int x2 = scale_coordinate(rect.x + rect.width, scale), y2 = scale_coordinate(rect.y + rect.height, scale);
+  return (RenRect) { x1, y1, x2 - x1, y2 - y1 };
+}
+
 static inline RenColor blend_pixel(RenColor dst, RenColor src) {
   int ia = 0xff - src.a;
   dst.r = ((src.r * src.a) + (dst.r * ia)) >> 8;
@@ -477,29 +1859,140 @@ void ren_draw_rect(RenSurface *rs, RenRect rect, RenColor color) {
   if (color.a == 0) { return; }
 
   SDL_Surface *surface = rs->surface;
-  const int surface_scale = rs->scale;
-
-  SDL_Rect dest_rect = { rect.x * surface_scale,
-                         rect.y * surface_scale,
-                         rect.width * surface_scale,
-                         rect.height * surface_scale };
+  RenRect scaled = ren_scale_rect(rect, rs->scale);
+  SDL_Rect dest_rect = { scaled.x, scaled.y, scaled.width, scaled.height };
 
   if (color.a == 0xff) {
-    uint32_t translated = SDL_MapRGB(surface->format, color.r, color.g, color.b);
+    // opaque, like SDL_MapRGB would make it
+    uint32_t translated = get_pixel_ops(surface->format)->pack(color, surface->format) | surface->format->Amask;
     SDL_FillRect(surface, &dest_rect, translated);
   } else {
-    // Seems like SDL doesn't handle clipping as we expect when using
-    // scaled blitting, so we "clip" manually.
-    SDL_Rect clip;
-    SDL_GetClipRect(surface, &clip);
-    if (!SDL_IntersectRect(&clip, &dest_rect, &dest_rect)) return;
+    // blend in place with the glyph kernels, using a constant coverage
+    if (!SDL_IntersectRect(&surface->clip_rect, &dest_rect, &dest_rect)) return;
+
+    const PixelOps *ops = get_pixel_ops(surface->format);
+    const uint32_t color_word = ops->pack(color, surface->format);
+    const uint32_t alpha_word = ops->pack((RenColor) { color.a, color.a, color.a, 0 }, surface->format);
+    uint32_t coverage[BLEND_CHUNK];
+    for (int i = 0; i < BLEND_CHUNK; ++i)
+      coverage[i] = alpha_word;
+
+    uint8_t *row = (uint8_t *) surface->pixels + dest_rect.y * surface->pitch + dest_rect.x * surface->format->BytesPerPixel;
+    for (int y = 0; y < dest_rect.h; ++y, row += surface->pitch) {
+      uint32_t *destination_pixel = (uint32_t *) row;
+      for (int x = 0; x < dest_rect.w; x += BLEND_CHUNK) {
+        const int count = dest_rect.w - x < BLEND_CHUNK ? dest_rect.w - x : BLEND_CHUNK;
+        blend_row(destination_pixel + x, coverage, count, color_word);
+      }
+    }
+  }
+}
+
+void ren_scroll_rect(RenSurface *rs, RenRect rect, int dy) {
+  SDL_Surface *surface = rs->surface;
+  RenRect scaled = ren_scale_rect(rect, rs->scale);
+
+  SDL_Rect r = { scaled.x, scaled.y, scaled.width, scaled.height };
+  if (!SDL_IntersectRect(&r, &(SDL_Rect){ 0, 0, surface->w, surface->h }, &r)) return;
+  // the caller only scrolls by a whole number of pixels
+  dy = scale_coordinate(dy, rs->scale);
+  if (dy == 0 || abs(dy) >= r.h) return;
+
+  // rows are moved whole, starting from the side the contents move towards
+  const int bytes_per_pixel = surface->format->BytesPerPixel;
+  uint8_t *pixels = (uint8_t *) surface->pixels + r.x * bytes_per_pixel;
+  const size_t row_size = r.w * bytes_per_pixel;
+  if (dy > 0) {
+    for (int y = r.y + r.h - 1; y >= r.y + dy; --y)
+      memcpy(pixels + y * surface->pitch, pixels + (y - dy) * surface->pitch, row_size);
+  } else {
+    for (int y = r.y; y < r.y + r.h + dy; ++y)
+      memcpy(pixels + y * surface->pitch, pixels + (y - dy) * surface->pitch, row_size);
+  }
+}
+
+/*************** Presentation ****************/
+// Frames ending less than a refresh interval after the last present are held
+// back, and presented along with the following ones once the interval is over:
+// the display couldn't show more than one of them anyway.
+static struct {
+  RenRect *rects;
+  int count, capacity;
+  int refresh_rate;
+  double interval;
+  uint64_t last_present;
+  uint64_t first_ready;   // when the oldest pending frame ended, 0 if none
+  uint64_t first_input;   // the oldest input not presented yet, 0 if none
+  double input_latency_total;
+  RenPresentStats stats;
+} present;
+
+static double counter_seconds(uint64_t ticks) {
+  return ticks / (double) SDL_GetPerformanceFrequency();
+}
+
+static void update_refresh_rate(RenWindow *window_renderer) {
+  SDL_DisplayMode mode;
+  int display = SDL_GetWindowDisplayIndex(window_renderer->window);
+  int rate = 0;
+  if (display >= 0 && SDL_GetCurrentDisplayMode(display, &mode) == 0) {
+    rate = mode.refresh_rate;
+  }
+  present.refresh_rate = rate > 0 ? rate : DEFAULT_REFRESH_RATE;
+  present.interval = 1.0 / present.refresh_rate;
+}
+
+static void present_pending(RenWindow *window_renderer, uint64_t now) {
+  renwin_present(window_renderer, present.rects, present.count);
+  RenPresentStats *stats = &present.stats;
+  stats->presents++;
+  stats->latency = counter_seconds(now - present.first_ready);
+  if (present.first_input) {
+    stats->input_latency = counter_seconds(now - present.first_input);
+    present.input_latency_total += stats->input_latency;
+    stats->input_presents++;
+    stats->avg_input_latency = present.input_latency_total / stats->input_presents;
+  }
+  present.last_present = now;
+  present.first_ready = present.first_input = 0;
+  present.count = 0;
+}
+
+double ren_present(RenWindow *window_renderer) {
+  if (!present.first_ready) {
+    return -1;
+  }
+  uint64_t now = SDL_GetPerformanceCounter();
+  double wait = present.interval - counter_seconds(now - present.last_present);
+  if (wait > PRESENT_SLACK) {
+    return wait;
+  }
+  present_pending(window_renderer, now);
+  return 0;
+}
 
-    uint32_t *pixel = (uint32_t *)draw_rect_surface->pixels;
-    *pixel = SDL_MapRGBA(draw_rect_surface->format, color.r, color.g, color.b, color.a);
-    SDL_BlitScaled(draw_rect_surface, NULL, surface, &dest_rect);
+void ren_input_received(uint32_t timestamp) {
+  if (present.first_input) {
+    return;
   }
+  // the timestamp is in milliseconds since SDL was initialized, it is moved
+  // back from now to keep the precision of the performance counter
+  uint64_t now = SDL_GetPerformanceCounter();
+  uint32_t age = SDL_GetTicks() - timestamp;
+  uint64_t age_ticks = (uint64_t) age * SDL_GetPerformanceFrequency() / 1000;
+  present.first_input = age_ticks < now ? now - age_ticks : now;
+}
+
+int ren_get_refresh_rate(void) {
+  return present.refresh_rate;
 }
 
+void ren_get_present_stats(RenPresentStats *stats) {
+  *stats = present.stats;
+  stats->refresh_rate = present.refresh_rate;
+}
+
+
 /*************** Window Management ****************/
 RenWindow* ren_init(SDL_Window *win) {
   assert(win);
@@ -514,8 +2007,11 @@ RenWindow* ren_init(SDL_Window *win) {
   renwin_init_surface(window_renderer);
   renwin_init_command_buf(window_renderer);
   renwin_clip_to_surface(window_renderer);
-  draw_rect_surface = SDL_CreateRGBSurface(0, 1, 1, 32,
-                       0xFF000000, 0x00FF0000, 0x0000FF00, 0x000000FF);
+  glyphset_mutex = SDL_CreateMutex();
+  renderer_freed = false;
+  glyph_rasterizer_init();
+  init_blend_row();
+  update_refresh_rate(window_renderer);
 
   return window_renderer;
 }
@@ -523,16 +2019,22 @@ RenWindow* ren_init(SDL_Window *win) {
 void ren_free(RenWindow* window_renderer) {
   assert(window_renderer);
   renwin_free(window_renderer);
-  SDL_FreeSurface(draw_rect_surface);
+  renderer_freed = true;
+  if (font_count == 0)
+    ren_free_glyphs();
   free(window_renderer->command_buf);
   window_renderer->command_buf = NULL;
   window_renderer->command_buf_size = 0;
   free(window_renderer);
+  free(present.rects);
+  present.rects = NULL;
+  present.count = present.capacity = 0;
 }
 
 void ren_resize_window(RenWindow *window_renderer) {
   renwin_resize_surface(window_renderer);
   renwin_update_scale(window_renderer);
+  update_refresh_rate(window_renderer);
 }
 
 
@@ -543,6 +2045,33 @@ void ren_update_rects(RenWindow *window_renderer, RenRect *rects, int count) {
     initial_frame = false;
   }
   renwin_update_rects(window_renderer, rects, count);
+  // the frame is done drawing, so the glyph atlas can be trimmed safely
+  glyph_atlas_end_frame();
+
+  if (present.count + count > present.capacity) {
+    int capacity = present.capacity ? present.capacity : 16;
+    while (capacity < present.count + count) { capacity *= 2; }
+    RenRect *new_rects = realloc(present.rects, capacity * sizeof(RenRect));
+    if (!new_rects) {
+      // present what is pending, the window is only partially up to date
+      // until the next frame otherwise
+      if (present.first_ready) {
+        present_pending(window_renderer, SDL_GetPerformanceCounter());
+      }
+      renwin_present(window_renderer, rects, count);
+      return;
+    }
+    present.rects = new_rects;
+    present.capacity = capacity;
+  }
+  memcpy(present.rects + present.count, rects, count * sizeof(RenRect));
+  present.count += count;
+  if (!present.first_ready) {
+    present.first_ready = SDL_GetPerformanceCounter();
+  } else {
+    present.stats.coalesced++;
+  }
+  ren_present(window_renderer);
 }
 
 
@@ -553,6 +2082,7 @@ void ren_set_clip_rect(RenWindow *window_renderer, RenRect rect) {
 
 void ren_get_size(RenWindow *window_renderer, int *x, int *y) {
   RenSurface rs = renwin_get_surface(window_renderer);
-  *x = rs.surface->w / rs.scale;
-  *y = rs.surface->h / rs.scale;
+  // rounded up, so that the last pixels are covered at fractional scales
+  *x = (int) ceil(rs.surface->w / rs.scale - 0.001);
+  *y = (int) ceil(rs.surface->h / rs.scale - 0.001);
 }
@@ -19,7 +19,16 @@ typedef enum { FONT_ANTIALIASING_NONE, FONT_ANTIALIASING_GRAYSCALE, FONT_ANTIALI
 typedef enum { FONT_STYLE_BOLD = 1, FONT_STYLE_ITALIC = 2, FONT_STYLE_UNDERLINE = 4, FONT_STYLE_SMOOTH = 8, FONT_STYLE_STRIKETHROUGH = 16 } ERenFontStyle;
 typedef struct { uint8_t b, g, r, a; } RenColor;
 typedef struct { int x, y, width, height; } RenRect;
-typedef struct { SDL_Surface *surface; int scale; } RenSurface;
+typedef struct { SDL_Surface *surface; float scale; } RenSurface;
+typedef struct {
+  int refresh_rate;           /* of the display showing the window, in Hz */
+  unsigned presents;
+  unsigned coalesced;         /* frames presented along with a later one */
+  unsigned input_presents;    /* presents showing the result of some input */
+  double latency;             /* seconds the oldest frame of the last present waited for it */
+  double input_latency;       /* seconds from the oldest input of the last such present to it */
+  double avg_input_latency;
+} RenPresentStats;
 
 struct RenWindow;
 typedef struct RenWindow RenWindow;
@@ -31,18 +40,29 @@ const char* ren_font_get_path(RenFont *font);
 void ren_font_free(RenFont *font);
 int ren_font_group_get_tab_size(RenFont **font);
 int ren_font_group_get_height(RenFont **font);
+bool ren_font_group_is_monospace(RenFont **font);
 float ren_font_group_get_size(RenFont **font);
 void ren_font_group_set_size(RenWindow *window_renderer, RenFont **font, float size);
 void ren_font_group_set_tab_size(RenFont **font, int n);
 double ren_font_group_get_width(RenWindow *window_renderer, RenFont **font, const char *text, size_t len, int *x_offset);
-double ren_draw_text(RenSurface *rs, RenFont **font, const char *text, size_t len, float x, int y, RenColor color);
+double ren_draw_text(RenSurface *rs, RenFont **font, const char *text, size_t len, float x, int y, RenColor color, int tab_size);
+void ren_set_glyph_cache_size(size_t size);
+void ren_set_font_cache_dir(const char *path);
+int ren_get_pending_glyphs(void);
+int ren_take_deferred_glyphs(void);
 
+RenRect ren_scale_rect(RenRect rect, float scale); /* Converts a rect in points to pixels. */
 void ren_draw_rect(RenSurface *rs, RenRect rect, RenColor color);
+void ren_scroll_rect(RenSurface *rs, RenRect rect, int dy);
 
 RenWindow* ren_init(SDL_Window *win);
 void ren_free(RenWindow* window_renderer);
 void ren_resize_window(RenWindow *window_renderer);
 void ren_update_rects(RenWindow *window_renderer, RenRect *rects, int count);
+double ren_present(RenWindow *window_renderer); /* Returns the seconds until the pending frames can be presented, or -1 if there are none. */
+void ren_input_received(uint32_t timestamp);
+int ren_get_refresh_rate(void);
+void ren_get_present_stats(RenPresentStats *stats);
 void ren_set_clip_rect(RenWindow *window_renderer, RenRect rect);
 void ren_get_size(RenWindow *window_renderer, int *x, int *y); /* Reports the size in points. */
 
@@ -1,17 +1,33 @@
-#include <assert.h>
 #include <stdio.h>
+#include <string.h>
 #include "renwindow.h"
 
 #ifdef LITE_USE_SDL_RENDERER
-static int query_surface_scale(RenWindow *ren) {
+static float query_surface_scale(RenWindow *ren) {
   int w_pixels, h_pixels;
   int w_points, h_points;
   SDL_GL_GetDrawableSize(ren->window, &w_pixels, &h_pixels);
   SDL_GetWindowSize(ren->window, &w_points, &h_points);
-  /* We consider that the ratio pixel/point will always be an integer and
-     it is the same along the x and the y axis. */
-  assert(w_pixels % w_points == 0 && h_pixels % h_points == 0 && w_pixels / w_points == h_pixels / h_points);
-  return w_pixels / w_points;
+  /* We consider that the ratio pixel/point is the same along the x and the
+     y axis. It may be fractional, as with a 150% display scale. */
+  return (float) w_pixels / w_points;
+}
+
+/* Drawing into the texture needs its pixels to be kept from one lock to the
+   next. These backends lock a buffer that lives as long as the texture, the
+   others may hand out a new one each time. */
+static bool renderer_keeps_pixels(SDL_Renderer *renderer) {
+  static const char *names[] = { "opengl", "opengles2", "opengles", "direct3d", "software" };
+  SDL_RendererInfo info;
+  if (SDL_GetRendererInfo(renderer, &info) != 0) {
+    return false;
+  }
+  for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+    if (strcmp(info.name, names[i]) == 0) {
+      return true;
+    }
+  }
+  return false;
 }
 
 static void setup_renderer(RenWindow *ren, int w, int h) {
@@ -19,6 +35,7 @@ static void setup_renderer(RenWindow *ren, int w, int h) {
      a call to SDL_GL_GetDrawableSize(). */
   if (!ren->renderer) {
     ren->renderer = SDL_CreateRenderer(ren->window, -1, 0);
+    ren->direct = renderer_keeps_pixels(ren->renderer);
   }
   if (ren->texture) {
     SDL_DestroyTexture(ren->texture);
@@ -37,12 +54,18 @@ void renwin_init_surface(RenWindow *ren) {
   }
   int w, h;
   SDL_GL_GetDrawableSize(ren->window, &w, &h);
-  ren->rensurface.surface = SDL_CreateRGBSurfaceWithFormat(0, w, h, 32, SDL_PIXELFORMAT_BGRA32);
+  setup_renderer(ren, w, h);
+  if (ren->direct) {
+    /* the surface only describes the texture, it points to its pixels while
+       the texture is locked */
+    ren->rensurface.surface = SDL_CreateRGBSurfaceWithFormatFrom(NULL, w, h, 32, w * 4, SDL_PIXELFORMAT_BGRA32);
+  } else {
+    ren->rensurface.surface = SDL_CreateRGBSurfaceWithFormat(0, w, h, 32, SDL_PIXELFORMAT_BGRA32);
+  }
   if (!ren->rensurface.surface) {
     fprintf(stderr, "Error creating surface: %s", SDL_GetError());
     exit(1);
   }
-  setup_renderer(ren, w, h);
 #endif
 }
 
@@ -53,11 +76,6 @@ void renwin_init_command_buf(RenWindow *ren) {
 }
 
 
-static RenRect scaled_rect(const RenRect rect, const int scale) {
-  return (RenRect) {rect.x * scale, rect.y * scale, rect.width * scale, rect.height * scale};
-}
-
-
 void renwin_clip_to_surface(RenWindow *ren) {
   SDL_SetClipRect(renwin_get_surface(ren).surface, NULL);
 }
@@ -65,11 +83,40 @@ void renwin_clip_to_surface(RenWindow *ren) {
 
 void renwin_set_clip_rect(RenWindow *ren, RenRect rect) {
   RenSurface rs = renwin_get_surface(ren);
-  RenRect sr = scaled_rect(rect, rs.scale);
+  RenRect sr = ren_scale_rect(rect, rs.scale);
   SDL_SetClipRect(rs.surface, &(SDL_Rect){.x = sr.x, .y = sr.y, .w = sr.width, .h = sr.height});
 }
 
 
+/* Readies the part of the surface that will be drawn to before the next
+   update. With the SDL renderer, only that part of the texture is locked and
+   uploaded again. */
+void renwin_lock_surface(UNUSED RenWindow *ren, UNUSED RenRect rect) {
+#ifdef LITE_USE_SDL_RENDERER
+  if (!ren->direct || ren->locked) {
+    return;
+  }
+  SDL_Surface *surface = ren->rensurface.surface;
+  RenRect sr = ren_scale_rect(rect, ren->rensurface.scale);
+  SDL_Rect lock = {.x = sr.x, .y = sr.y, .w = sr.width, .h = sr.height};
+  if (!SDL_IntersectRect(&lock, &(SDL_Rect){.x = 0, .y = 0, .w = surface->w, .h = surface->h}, &lock)) {
+    return;
+  }
+  void *pixels;
+  int pitch;
+  if (SDL_LockTexture(ren->texture, &lock, &pixels, &pitch) != 0) {
+    fprintf(stderr, "Error locking texture: %s", SDL_GetError());
+    exit(1);
+  }
+  /* the surface keeps the coordinates of the whole window, nothing is drawn
+     outside of the locked rect */
+  surface->pixels = (uint8_t *) pixels - lock.y * pitch - lock.x * surface->format->BytesPerPixel;
+  surface->pitch = pitch;
+  ren->locked = true;
+#endif
+}
+
+
 RenSurface renwin_get_surface(RenWindow *ren) {
 #ifdef LITE_USE_SDL_RENDERER
   return ren->rensurface;
@@ -91,7 +138,6 @@ void renwin_resize_surface(UNUSED RenWindow *ren) {
   if (new_w != ren->rensurface.surface->w || new_h != ren->rensurface.surface->h) {
     renwin_init_surface(ren);
     renwin_clip_to_surface(ren);
-    setup_renderer(ren, new_w, new_h);
   }
 #endif
 }
@@ -110,17 +156,38 @@ void renwin_show_window(RenWindow *ren) {
   SDL_ShowWindow(ren->window);
 }
 
-void renwin_update_rects(RenWindow *ren, RenRect *rects, int count) {
+/* Hands the rects drawn in the surface over to the window, they are shown by
+   the next renwin_present(). */
+void renwin_update_rects(UNUSED RenWindow *ren, UNUSED RenRect *rects, UNUSED int count) {
 #ifdef LITE_USE_SDL_RENDERER
-  const int scale = ren->rensurface.scale;
-  for (int i = 0; i < count; i++) {
-    const RenRect *r = &rects[i];
-    const int x = scale * r->x, y = scale * r->y;
-    const int w = scale * r->width, h = scale * r->height;
-    const SDL_Rect sr = {.x = x, .y = y, .w = w, .h = h};
-    int32_t *pixels = ((int32_t *) ren->rensurface.surface->pixels) + x + ren->rensurface.surface->w * y;
-    SDL_UpdateTexture(ren->texture, &sr, pixels, ren->rensurface.surface->w * 4);
+  if (ren->direct) {
+    if (ren->locked) {
+      /* uploads the locked rect */
+      SDL_UnlockTexture(ren->texture);
+      ren->rensurface.surface->pixels = NULL;
+      ren->locked = false;
+    }
+  } else {
+    SDL_Surface *surface = ren->rensurface.surface;
+    const SDL_Rect bounds = {.x = 0, .y = 0, .w = surface->w, .h = surface->h};
+    for (int i = 0; i < count; i++) {
+      const RenRect r = ren_scale_rect(rects[i], ren->rensurface.scale);
+      SDL_Rect sr = {.x = r.x, .y = r.y, .w = r.width, .h = r.height};
+      if (!SDL_IntersectRect(&sr, &bounds, &sr)) {
+        continue;
+      }
+      int32_t *pixels = ((int32_t *) surface->pixels) + sr.x + surface->w * sr.y;
+      SDL_UpdateTexture(ren->texture, &sr, pixels, surface->w * 4);
+    }
   }
+#endif
+}
+
+void renwin_present(RenWindow *ren, UNUSED RenRect *rects, int count) {
+  if (count == 0) {
+    return;
+  }
+#ifdef LITE_USE_SDL_RENDERER
   SDL_RenderCopy(ren->renderer, ren->texture, NULL, NULL);
   SDL_RenderPresent(ren->renderer);
 #else
@@ -132,6 +199,9 @@ void renwin_free(RenWindow *ren) {
   SDL_DestroyWindow(ren->window);
   ren->window = NULL;
 #ifdef LITE_USE_SDL_RENDERER
+  if (ren->locked) {
+    SDL_UnlockTexture(ren->texture);
+  }
   SDL_DestroyTexture(ren->texture);
   SDL_DestroyRenderer(ren->renderer);
   SDL_FreeSurface(ren->rensurface.surface);
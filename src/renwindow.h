@@ -12,6 +12,9 @@ struct RenWindow {
   SDL_Renderer *renderer;
   SDL_Texture *texture;
   RenSurface rensurface;
+  /* frames are drawn straight into the locked texture */
+  bool direct;
+  bool locked;
 #endif
 };
 typedef struct RenWindow RenWindow;
@@ -20,10 +23,12 @@ void renwin_init_surface(RenWindow *ren);
 void renwin_init_command_buf(RenWindow *ren);
 void renwin_clip_to_surface(RenWindow *ren);
 void renwin_set_clip_rect(RenWindow *ren, RenRect rect);
+void renwin_lock_surface(RenWindow *ren, RenRect rect);
 void renwin_resize_surface(RenWindow *ren);
 void renwin_update_scale(RenWindow *ren);
 void renwin_show_window(RenWindow *ren);
 void renwin_update_rects(RenWindow *ren, RenRect *rects, int count);
+void renwin_present(RenWindow *ren, RenRect *rects, int count);
 void renwin_free(RenWindow *ren);
 RenSurface renwin_get_surface(RenWindow *ren);
 